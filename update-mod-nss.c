@@ -17,9 +17,18 @@
 
 #define _GNU_SOURCE
 
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <assert.h>
 #include <dirent.h>
 #include <limits.h>
@@ -31,6 +40,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <poll.h>
 #include <time.h>
 #include <pwd.h>
 
@@ -56,8 +66,63 @@
 static const char httpd_conf_dir[] = "/etc/httpd";
 static const char acme_cert_dir[] = "/var/lib/acme";
 
+/* Hostname currently being processed (points into cert_hostnames) */
 static const char *cert_hostname;
 
+/* All hostnames to be processed in this invocation */
+static const char **cert_hostnames;
+static unsigned int num_cert_hostnames;
+
+/* Scan /var/lib/acme for *.new symlinks instead of using HOSTNAME args? */
+static _Bool scan_new_certs;
+
+/* Hard link unmodified files into the new directory instead of copying? */
+static _Bool hardlink_files;
+
+/* Number of file copy worker threads (0 = copy serially) */
+static unsigned int copy_jobs;
+
+/* Batch stat/unlink syscalls with io_uring?  (Cleared if unsupported.) */
+static _Bool use_uring;
+
+/* Run as a daemon, watching /var/lib/acme with inotify? */
+static _Bool daemon_mode;
+
+/* Daemon mode: window (in seconds) for batching renewals into one rotation */
+static unsigned int batch_window = 5;
+
+/* Pre-stage the next database directory (instead of processing certs)? */
+static _Bool prestage_mode;
+
+/* Log per-phase timing (as a JSON line) after each rotation? */
+static _Bool show_timing;
+
+/* Write a Prometheus textfile metrics snapshot after each rotation? */
+static _Bool metrics_mode;
+
+/* Flush the new database directory to disk before publishing it? */
+static _Bool sync_mode;
+
+/* Update the live (SQLite) database in place instead of rotating? */
+static _Bool inplace_mode;
+
+/* Own the httpd reload (debounced, one reload per wave)? */
+static _Bool reload_mode;
+
+/* Debounce window (in seconds) before an owned reload is issued */
+static unsigned int reload_window = 5;
+
+/* The command that reloads httpd (overridable with --reload-cmd) */
+static const char *reload_cmd = "systemctl reload httpd.service";
+
+/* Benchmark the copy/delete engines in a scratch directory (and exit)? */
+static _Bool bench_mode;
+
+/* Benchmark mode: synthetic source tree parameters */
+static unsigned int bench_num_files = 500;
+static unsigned int bench_num_subdirs = 4;
+static unsigned int bench_num_links = 10;
+
 /* Minimum message severity that will be logged */
 static int verbosity = LOG_NOTICE;
 
@@ -71,7 +136,7 @@ static gid_t nss_gid;
 /*
  * mod_nss database directory names
  */
-#define NSSDB_DIR_PATTERN	"alias-YYYYMMDDHHMMSS"
+#define NSSDB_DIR_PATTERN	"alias-YYYYMMDDHHMMSSmmm"
 #define NSSDB_DIR_PTN_SIZE	(sizeof NSSDB_DIR_PATTERN)
 #define NSSDB_DIR_PTN_LEN	(NSSDB_DIR_PTN_SIZE - 1)
 
@@ -79,13 +144,52 @@ static gid_t nss_gid;
 #define NSSDB_DIR_PFX_SIZE	(sizeof NSSDB_DIR_PREFIX)
 #define NSSDB_DIR_PFX_LEN	(NSSDB_DIR_PFX_SIZE - 1)
 
-#define NSSDB_DIR_TSTAMP	"YYYYMMDDHHMMSS"
+#define NSSDB_DIR_TSTAMP	"YYYYMMDDHHMMSSmmm"
 #define NSSDB_DIR_TS_SIZE	(sizeof NSSDB_DIR_TSTAMP)
 #define NSSDB_DIR_TS_LEN	(NSSDB_DIR_TS_SIZE - 1)
 
+/* The sub-second (millisecond) component of the timestamp */
+#define NSSDB_DIR_MSEC_LEN	3
+
+/* Generation names created before the millisecond component was added */
+#define NSSDB_DIR_OLD_PTN_LEN	(NSSDB_DIR_PTN_LEN - NSSDB_DIR_MSEC_LEN)
+
 static char new_dbdir_name[NSSDB_DIR_PTN_SIZE];
 static char old_dbdir_name[NSSDB_DIR_PTN_SIZE];
 
+/*
+ * Holding name for an old database directory awaiting background deletion
+ */
+#define TRASH_DIR_PREFIX	".trash-"
+#define TRASH_DIR_PFX_SIZE	(sizeof TRASH_DIR_PREFIX)
+#define TRASH_DIR_PFX_LEN	(TRASH_DIR_PFX_SIZE - 1)
+
+/* The files that make up an NSS database (legacy DBM and SQLite backends) */
+static const char *const nssdb_dbm_file_names[] = {
+	"cert8.db", "key3.db", "secmod.db", NULL
+};
+static const char *const nssdb_sql_file_names[] = {
+	"cert9.db", "key4.db", "pkcs11.txt", NULL
+};
+
+/* Set by old_nssdb_dir() according to the backend actually on disk */
+static const char *const *nssdb_file_names = nssdb_dbm_file_names;
+static _Bool nssdb_sql;
+
+/* Name of the marker file that identifies a pre-staged database directory */
+static const char prestage_marker[] = ".prestaged-from";
+
+/* Name of the per-generation manifest file (see manifest_load()) */
+static const char manifest_file_name[] = ".manifest";
+
+/* Lock file (in /etc/httpd) that serializes concurrent instances */
+static const char lock_file_name[] = ".update-mod-nss.lock";
+
+/* Runtime state directory and the "generation changed" reload marker */
+static const char run_dir[] = "/run/update-mod-nss";
+static const char reload_marker[] = "/run/update-mod-nss/reload-pending";
+static const char reload_lock[] = "/run/update-mod-nss/.reload.lock";
+
 
 /*******************************************************************************
  *
@@ -95,20 +199,129 @@ static char old_dbdir_name[NSSDB_DIR_PTN_SIZE];
  *
  ******************************************************************************/
 
+/*
+ * Low-severity messages (INFO and DEBUG) are formatted into a buffer and
+ * flushed in batches, so that a debug-level walk of a large directory tree
+ * doesn't pay a synchronous journald round-trip per dirent.  Messages of
+ * NOTICE or higher severity flush the buffer (preserving ordering) and are
+ * then emitted directly, so the FATAL paths never lose buffered context.
+ */
+#define LOG_BUF_SIZE	(64 * 1024)
+#define LOG_MSG_SIZE	1024
+#define LOG_FLUSH_IOVS	64
+
+struct log_record {
+	unsigned short	size;		/* entire record, header included */
+	unsigned char	severity;
+	char		text[];
+};
+
+static char log_buf[LOG_BUF_SIZE] __attribute__((aligned(2)));
+static size_t log_buf_used;
+static pthread_mutex_t log_buf_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Must be called with log_buf_mutex held */
+static void log_flush_locked(void)
+{
+	struct iovec iov[LOG_FLUSH_IOVS];
+	struct log_record *rec;
+	unsigned int num_iovs;
+	size_t pos;
+
+	num_iovs = 0;
+
+	for (pos = 0; pos < log_buf_used; pos += rec->size) {
+
+		rec = (struct log_record *)(log_buf + pos);
+
+		if (use_syslog) {
+			syslog(rec->severity, "%s", rec->text);
+			continue;
+		}
+
+		iov[num_iovs].iov_base = rec->text;
+		iov[num_iovs].iov_len = strlen(rec->text);
+
+		if (++num_iovs == LOG_FLUSH_IOVS) {
+			if (writev(STDERR_FILENO, iov, num_iovs) < 0)
+				abort();
+			num_iovs = 0;
+		}
+	}
+
+	if (num_iovs > 0 && writev(STDERR_FILENO, iov, num_iovs) < 0)
+		abort();
+
+	log_buf_used = 0;
+}
+
+/* atexit() handler; also usable directly */
+static void log_flush(void)
+{
+	int err;
+
+	err = pthread_mutex_lock(&log_buf_mutex);
+	if (err != 0)
+		abort();	/* can't FATAL() from inside the logger */
+
+	log_flush_locked();
+
+	err = pthread_mutex_unlock(&log_buf_mutex);
+	if (err != 0)
+		abort();
+}
+
 static void
 __attribute__((format(printf, 2, 3)))
 log_msg(const int severity, const char *const restrict format, ...)
 {
+	char msg[LOG_MSG_SIZE];
+	struct log_record *rec;
+	size_t rec_size;
 	va_list ap;
+	int len, err;
 
 	va_start(ap, format);
+	len = vsnprintf(msg, sizeof msg, format, ap);
+	va_end(ap);
 
-	if (!use_syslog)
-		vfprintf(stderr, format, ap);
-	else
-		vsyslog(severity, format, ap);
+	if (len < 0)
+		abort();
+	if ((size_t)len >= sizeof msg)
+		len = sizeof msg - 1;
 
-	va_end(ap);
+	err = pthread_mutex_lock(&log_buf_mutex);
+	if (err != 0)
+		abort();	/* can't FATAL() from inside the logger */
+
+	if (severity < LOG_INFO) {
+
+		/* Flush first, so earlier buffered messages stay in order */
+		log_flush_locked();
+
+		if (use_syslog)
+			syslog(severity, "%s", msg);
+		else
+			fputs(msg, stderr);
+	}
+	else {
+		/* Record size, rounded up to the header alignment */
+		rec_size = (sizeof *rec + len + 1 + 1) & ~(size_t)1;
+
+		if (log_buf_used + rec_size > sizeof log_buf)
+			log_flush_locked();
+
+		rec = (struct log_record *)(log_buf + log_buf_used);
+		rec->size = rec_size;
+		rec->severity = severity;
+		memcpy(rec->text, msg, len + 1);
+
+		log_buf_used += rec_size;
+	}
+
+	err = pthread_mutex_unlock(&log_buf_mutex);
+	if (err != 0)
+		abort();
 }
 
 /* Log DEBUG messages (if enabled) at LOG_INFO, so syslog doesn't drop them */
@@ -171,969 +384,4529 @@ log_msg(const int severity, const char *const restrict format, ...)
 /*******************************************************************************
  *
  *
- * 	Command-line parsing
+ * 	Timing instrumentation (--timing)
  *
  *
  ******************************************************************************/
 
-#define USAGE_MESSAGE	"Usage: %s {-h} [-d|-i] [-t|-s] NSS_USER HOSTNAME\n"
+/* More than enough for the phases of a single rotation */
+#define TIMING_MAX_SPANS	8
 
-#define HELP_MESSAGE	USAGE_MESSAGE \
-			"  -h,  --help         show this message\n" \
-			"  -t,  --tty          log to stderr\n" \
-			"  -s,  --syslog       log to syslog\n" \
-			"  -d,  --debug        log debugging (and " \
-						"informational) messages\n" \
-			"  -i,  --info         log informational messages\n"
+struct timing_span {
+	const char	*name;
+	int64_t		ns;
+};
 
-static void
-__attribute__((noreturn))
-show_help(const char *const argv0)
+static struct timing_span timing_spans[TIMING_MAX_SPANS];
+static unsigned int num_timing_spans;
+
+/* Phase currently being timed */
+static const char *timing_span_name;
+static struct timespec timing_span_start;
+
+/*
+ * Counters are updated unconditionally (they're far too cheap to matter) and
+ * atomically, because copy_file() may run on worker threads.
+ */
+static uint64_t timing_files_copied;
+static uint64_t timing_files_linked;
+static uint64_t timing_bytes_copied;
+static uint64_t timing_dirents_scanned;
+
+#define TIMING_COUNT(counter, amount) \
+		__atomic_fetch_add(&(counter), (amount), __ATOMIC_RELAXED)
+
+static void timing_begin(const char *const name)
 {
-	printf(HELP_MESSAGE, argv0 == NULL ? "(unknown)" : argv0);
-	exit(EXIT_SUCCESS);
+	if (!show_timing && !metrics_mode)
+		return;
+
+	timing_span_name = name;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &timing_span_start) < 0)
+		FATAL("Failed to read monotonic clock: %m\n");
 }
 
-static _Bool arg_matches(const char *const restrict arg,
-			 const char *const restrict short_opt,
-			 const char *const restrict long_opt)
+/* Defined in the metrics section below */
+static void metrics_phase_observe(const char *name, int64_t ns);
+
+/* Record a span measured elsewhere (e.g. on the overlapped copy thread) */
+static void timing_add(const char *const name, const int64_t ns)
 {
-	return (short_opt != NULL && strcmp(arg, short_opt) == 0)
-		|| (long_opt != NULL && strcmp(arg, long_opt) == 0);
+	metrics_phase_observe(name, ns);
+
+	if (!show_timing)
+		return;
+
+	assert(num_timing_spans < TIMING_MAX_SPANS);
+
+	timing_spans[num_timing_spans].name = name;
+	timing_spans[num_timing_spans].ns = ns;
+	++num_timing_spans;
 }
 
-static void parse_args(const int argc, char **const argv)
+static void timing_finish(void)
 {
-	_Bool allow_root = 0;
-	struct passwd *pw;
-	int i;
+	struct timespec now;
 
-	/* Make an intelligent guess about where to send errors */
-	use_syslog = !isatty(fileno(stderr));
-
-	if (argc < 3) {
-		if (argc == 2 && arg_matches(argv[1], "-h", "--help"))
-			show_help(argv[0]);
-		FATAL(USAGE_MESSAGE, argv[0] == NULL ? "(unknown)" : argv[0]);
-	}
+	if (!show_timing && !metrics_mode)
+		return;
 
-	for (i = 1; i < argc - 2; ++i) {
+	if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+		FATAL("Failed to read monotonic clock: %m\n");
 
-		if (arg_matches(argv[i], "-h", "--help")) {
-			show_help(argv[0]);
-		}
-		else if (arg_matches(argv[i], "-d", "--debug")) {
-			verbosity = LOG_DEBUG;
-		}
-		else if (arg_matches(argv[i], "-i", "--info")) {
-			verbosity = LOG_INFO;
-		}
-		else if (arg_matches(argv[i], "-t", "--tty")) {
-			use_syslog = 0;
-		}
-		else if (arg_matches(argv[i], "-s", "--syslog")) {
-			use_syslog = 1;
-		}
-		else if (arg_matches(argv[i], NULL, "--allow-root")) {
-			allow_root = 1;
-		}
-		else {
-			if (!use_syslog)
-				ERROR(USAGE_MESSAGE, argv[0]);
-			FATAL("Invalid option: %s\n", argv[i]);
-		}
-	}
+	timing_add(timing_span_name,
+		   (int64_t)(now.tv_sec - timing_span_start.tv_sec)
+				* 1000000000
+			+ (now.tv_nsec - timing_span_start.tv_nsec));
+}
 
-	errno = 0; pw = getpwnam(argv[i]);
-	if (pw == NULL) {
-		if (errno == 0)
-			FATAL("User does not exist: %s\n", argv[i]);
-		else
-			FATAL("Failed to get user info: %s: %m\n", argv[i]);
-	}
+/*
+ * Emit all recorded spans and counters as a single JSON line (and reset them,
+ * for the sake of daemon mode).
+ */
+static void timing_report(void)
+{
+	char buf[TIMING_MAX_SPANS * 64 + 256];
+	unsigned int i;
+	int len;
 
-	nss_uid = pw->pw_uid;
-	if (nss_uid == 0 && !allow_root)
-		FATAL("NSS user is root but --allow-root not specified\n");
+	if (!show_timing)
+		goto reset;
 
-	nss_gid = pw->pw_gid;
-	if (nss_gid == 0 && !allow_root)
-		FATAL("NSS group is root but --allow-root not specified\n");
+	len = snprintf(buf, sizeof buf, "{\"phases\":{");
 
-	cert_hostname = argv[i + 1];
+	for (i = 0; i < num_timing_spans; ++i) {
+		len += snprintf(buf + len, sizeof buf - len,
+				"%s\"%s\":%" PRId64,
+				i == 0 ? "" : ",",
+				timing_spans[i].name, timing_spans[i].ns);
+	}
 
-	DEBUG("  user = %s\n", pw->pw_name);
-	DEBUG("  hostname = %s\n", cert_hostname);
+	len += snprintf(buf + len, sizeof buf - len,
+			"},\"files_copied\":%" PRIu64
+			",\"files_linked\":%" PRIu64
+			",\"bytes_copied\":%" PRIu64
+			",\"dirents_scanned\":%" PRIu64 "}",
+			timing_files_copied, timing_files_linked,
+			timing_bytes_copied, timing_dirents_scanned);
+
+	if ((size_t)len >= sizeof buf)
+		FATAL("Timing report too large for buffer\n");
+
+	log_msg(LOG_INFO, "TIMING: %s\n", buf);
+
+reset:
+	num_timing_spans = 0;
+	timing_files_copied = 0;
+	timing_files_linked = 0;
+	timing_bytes_copied = 0;
+	timing_dirents_scanned = 0;
 }
 
 
 /*******************************************************************************
  *
  *
- * 	mod_nss database directories
+ * 	Metrics export (--metrics)
  *
  *
  ******************************************************************************/
 
 /*
- * Finds the existing mod_nss database directory (by following the
- * /etc/httpd/alias symlink).  Also populates old_nssdb_dir.
- *
- * Returns a file descriptor that refers to the existing directory.  Link info
- * is returned via linkst.
+ * After each rotation, a Prometheus-textfile-format snapshot is written
+ * atomically (write to a temporary file, then rename) under
+ * /run/update-mod-nss, where node_exporter's textfile collector picks it up
+ * without any extra process.  Counters and phase-duration histograms cover
+ * the life of the process (multiple rotations in daemon mode); per-hostname
+ * last-success timestamps from earlier runs are carried over from the
+ * previous snapshot.
  */
-static int old_nssdb_dir(const int httpd_conf_dirfd, struct stat *const linkst)
+
+#define METRICS_MAX_PHASES	TIMING_MAX_SPANS
+
+/* Histogram bucket upper bounds (in seconds); the last bucket is +Inf */
+static const double metrics_buckets[] = { 0.01, 0.05, 0.25, 1.0, 5.0, 10.0 };
+#define METRICS_NUM_BUCKETS \
+		(sizeof metrics_buckets / sizeof metrics_buckets[0])
+
+struct metrics_phase {
+	const char	*name;
+	uint64_t	buckets[METRICS_NUM_BUCKETS + 1];
+	uint64_t	count;
+	double		sum;
+};
+
+static struct metrics_phase metrics_phases[METRICS_MAX_PHASES];
+static unsigned int num_metrics_phases;
+
+/* Totals since the process started */
+static uint64_t metrics_rotations;
+static uint64_t metrics_files_copied;
+static uint64_t metrics_files_linked;
+static uint64_t metrics_bytes_copied;
+static uint64_t metrics_dirents_scanned;
+static uint64_t metrics_certs_removed;
+
+static const char metrics_path[] =
+			"/run/update-mod-nss/update-mod-nss.prom";
+static const char metrics_tmp_path[] =
+			"/run/update-mod-nss/update-mod-nss.prom.tmp";
+
+static const char last_success_metric[] =
+			"update_mod_nss_last_success_timestamp_seconds";
+
+/* Called (via timing_add) for every completed phase span */
+static void metrics_phase_observe(const char *const name, const int64_t ns)
 {
-	int fd;
+	struct metrics_phase *phase;
+	double seconds;
+	unsigned int i;
 
-	fd = openat(httpd_conf_dirfd, "alias", O_RDONLY | O_NOFOLLOW | O_PATH);
-	if (fd < 0) {
-		FATAL("Failed to open symbolic link: %s/alias: %m\n",
-		      httpd_conf_dir);
+	if (!metrics_mode)
+		return;
+
+	for (i = 0; i < num_metrics_phases; ++i) {
+		if (strcmp(metrics_phases[i].name, name) == 0)
+			break;
 	}
 
-	if (fstat(fd, linkst) < 0) {
-		FATAL("Failed to read symbolic link info: %s/alias: %m\n",
-		      httpd_conf_dir);
+	if (i == num_metrics_phases) {
+		assert(num_metrics_phases < METRICS_MAX_PHASES);
+		metrics_phases[num_metrics_phases++].name = name;
 	}
 
-	if (!S_ISLNK(linkst->st_mode))
-		FATAL("Not a symbolic link: %s/alias\n", httpd_conf_dir);
+	phase = metrics_phases + i;
+	seconds = ns / 1e9;
 
-	if (linkst->st_size > (off_t)NSSDB_DIR_PTN_LEN) {
-		FATAL("Symbolic link target too long: %s/alias\n",
-		      httpd_conf_dir);
+	for (i = 0; i < METRICS_NUM_BUCKETS; ++i) {
+		if (seconds <= metrics_buckets[i])
+			break;
 	}
 
-	memset(old_dbdir_name, 0, NSSDB_DIR_PTN_SIZE);
+	++phase->buckets[i];
+	++phase->count;
+	phase->sum += seconds;
+}
 
-	if (readlinkat(fd, "", old_dbdir_name, NSSDB_DIR_PTN_LEN) < 0) {
-		FATAL("Failed to read symbolic link target: %s/alias: %m\n",
-		      httpd_conf_dir);
-	}
+/* Fold the (about to be reset) per-rotation timing counters into the totals */
+static void metrics_rotation_complete(void)
+{
+	if (!metrics_mode)
+		return;
 
-	if (memchr(old_dbdir_name, '/', NSSDB_DIR_PTN_LEN) != NULL) {
-		FATAL("Symbolic link target invalid: %s/alias -> %s\n",
-		      httpd_conf_dir, old_dbdir_name);
+	++metrics_rotations;
+	metrics_files_copied += timing_files_copied;
+	metrics_files_linked += timing_files_linked;
+	metrics_bytes_copied += timing_bytes_copied;
+	metrics_dirents_scanned += timing_dirents_scanned;
+}
+
+/*
+ * Read the previous snapshot (if any), so that last-success timestamps for
+ * hostnames not processed by this run can be carried over.  Returns a
+ * malloc'd, NUL-terminated copy of the file, or NULL.
+ */
+static char *metrics_read_previous(void)
+{
+	ssize_t bytes_read;
+	struct stat st;
+	char *text;
+	int fd;
+
+	fd = open(metrics_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return NULL;
+		FATAL("Failed to open file: %s: %m\n", metrics_path);
 	}
 
-	if (close(fd) < 0) {
-		FATAL("Failed to close symbolic link: %s/alias: %m\n",
-		      httpd_conf_dir);
+	if (fstat(fd, &st) < 0)
+		FATAL("Failed to read file info: %s: %m\n", metrics_path);
+
+	if (!S_ISREG(st.st_mode) || st.st_size < 0
+			|| st.st_size > SSIZE_MAX) {
+		FATAL("File size invalid: %s\n", metrics_path);
 	}
 
-	fd = openat(httpd_conf_dirfd, old_dbdir_name,
-		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
-	if (fd < 0) {
-		FATAL("Failed to open directory: %s/%s: %m\n",
-		      httpd_conf_dir, old_dbdir_name);
+	text = malloc(st.st_size + 1);
+	if (text == NULL)
+		FATAL("Memory allocation failed: %m\n");
+
+	bytes_read = read(fd, text, st.st_size);
+	if (bytes_read < 0)
+		FATAL("Failed to read file: %s: %m\n", metrics_path);
+	if (bytes_read != st.st_size)
+		FATAL("Failed to read complete file: %s\n", metrics_path);
+
+	text[st.st_size] = 0;
+
+	if (close(fd) < 0)
+		FATAL("Failed to close file: %s: %m\n", metrics_path);
+
+	return text;
+}
+
+/* Is the hostname in the label of this last-success line being re-stamped? */
+static _Bool metrics_hostname_current(const char *const label)
+{
+	const char *end;
+	unsigned int h;
+	size_t len;
+
+	end = strchr(label, '"');
+	if (end == NULL)
+		return 0;
+
+	len = end - label;
+
+	for (h = 0; h < num_cert_hostnames; ++h) {
+		if (strlen(cert_hostnames[h]) == len
+				&& memcmp(cert_hostnames[h], label, len)
+					== 0) {
+			return 1;
+		}
 	}
 
-	return fd;
+	return 0;
 }
 
-/*
- * Create a directory for the new copy of the mod_nss database.  Also populates
- * new_dbdir_name.
- *
- * Returns a file descriptor that refers to the new directory.
- */
-static int new_nssdb_dir(const int httpd_conf_dirfd)
+static void metrics_write(void)
 {
-	/* Points to the timestamp in new_dbdir_name */
-	static char *const new_dbdir_name_ts =
-					new_dbdir_name + NSSDB_DIR_PFX_LEN;
+	static const char label_pfx[] = "{hostname=\"";
 
-	struct tm *tm;
+	const struct metrics_phase *phase;
+	char *prev, *line, *next;
+	unsigned int i, b, h;
+	uint64_t cumulative;
 	time_t now;
-	int dirfd;
+	FILE *out;
+	int fd;
 
-	now = time(NULL);
-	tm = gmtime(&now);
+	if (!metrics_mode)
+		return;
 
-	/* Am I being too optimistic? */
-	if (tm->tm_year > 9999 - 1900) {
-		FATAL("This program is not supported in the year %d\n",
-		      tm->tm_year + 1900);
-	}
+	if (mkdir(run_dir, 0755) < 0 && errno != EEXIST)
+		FATAL("Failed to create directory: %s: %m\n", run_dir);
 
-	memcpy(new_dbdir_name, NSSDB_DIR_PREFIX, NSSDB_DIR_PFX_LEN);
+	prev = metrics_read_previous();
 
-	if (strftime(new_dbdir_name_ts, NSSDB_DIR_TS_SIZE, "%Y%m%d%H%M%S", tm)
-			!= NSSDB_DIR_TS_LEN)  {
-		FATAL("Failed to format timestamp (%ld)\n", now);
-	}
+	fd = open(metrics_tmp_path,
+		  O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+		  0644);
+	if (fd < 0)
+		FATAL("Failed to create file: %s: %m\n", metrics_tmp_path);
+
+	out = fdopen(fd, "w");
+	if (out == NULL)
+		FATAL("Failed to open stream: %s: %m\n", metrics_tmp_path);
+
+	fprintf(out,
+		"# TYPE update_mod_nss_rotations_total counter\n"
+		"update_mod_nss_rotations_total %" PRIu64 "\n"
+		"# TYPE update_mod_nss_files_copied_total counter\n"
+		"update_mod_nss_files_copied_total %" PRIu64 "\n"
+		"# TYPE update_mod_nss_files_linked_total counter\n"
+		"update_mod_nss_files_linked_total %" PRIu64 "\n"
+		"# TYPE update_mod_nss_bytes_copied_total counter\n"
+		"update_mod_nss_bytes_copied_total %" PRIu64 "\n"
+		"# TYPE update_mod_nss_dirents_scanned_total counter\n"
+		"update_mod_nss_dirents_scanned_total %" PRIu64 "\n"
+		"# TYPE update_mod_nss_certs_removed_total counter\n"
+		"update_mod_nss_certs_removed_total %" PRIu64 "\n",
+		metrics_rotations, metrics_files_copied,
+		metrics_files_linked, metrics_bytes_copied,
+		metrics_dirents_scanned, metrics_certs_removed);
+
+	fprintf(out,
+		"# TYPE update_mod_nss_phase_duration_seconds histogram\n");
+
+	for (i = 0; i < num_metrics_phases; ++i) {
+
+		phase = metrics_phases + i;
+		cumulative = 0;
+
+		for (b = 0; b < METRICS_NUM_BUCKETS; ++b) {
+			cumulative += phase->buckets[b];
+			fprintf(out,
+				"update_mod_nss_phase_duration_seconds_bucket"
+					"{phase=\"%s\",le=\"%g\"} %" PRIu64
+					"\n",
+				phase->name, metrics_buckets[b], cumulative);
+		}
 
-	if (mkdirat(httpd_conf_dirfd, new_dbdir_name, 0750) < 0) {
-		FATAL("Failed to create directory: %s/%s: %m\n",
-		      httpd_conf_dir, new_dbdir_name);
+		cumulative += phase->buckets[METRICS_NUM_BUCKETS];
+		fprintf(out,
+			"update_mod_nss_phase_duration_seconds_bucket"
+				"{phase=\"%s\",le=\"+Inf\"} %" PRIu64 "\n"
+			"update_mod_nss_phase_duration_seconds_sum"
+				"{phase=\"%s\"} %g\n"
+			"update_mod_nss_phase_duration_seconds_count"
+				"{phase=\"%s\"} %" PRIu64 "\n",
+			phase->name, cumulative,
+			phase->name, phase->sum,
+			phase->name, phase->count);
 	}
 
-	dirfd = openat(httpd_conf_dirfd, new_dbdir_name,
-		       O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
-	if (dirfd < 0) {
-		FATAL("Failed to open directory: %s/%s: %m\n",
-		      httpd_conf_dir, new_dbdir_name);
-	}
+	fprintf(out, "# TYPE %s gauge\n", last_success_metric);
 
-	if (fchownat(dirfd, "", -1, nss_gid, AT_EMPTY_PATH) < 0) {
-		FATAL("Failed to change owner of directory: %s/%s: %m\n",
-		      httpd_conf_dir, new_dbdir_name);
+	now = time(NULL);
+
+	for (h = 0; h < num_cert_hostnames; ++h) {
+		fprintf(out, "%s%s%s\"} %lld\n", last_success_metric,
+			label_pfx, cert_hostnames[h], (long long)now);
 	}
 
-	return dirfd;
+	/* Carry over the stamps of hostnames not processed by this run */
+	if (prev != NULL) {
+
+		for (line = prev; (next = strchr(line, '\n')) != NULL;
+							line = next + 1) {
+			*next = 0;
+
+			if (strncmp(line, last_success_metric,
+				    sizeof last_success_metric - 1) != 0)
+				continue;
+
+			if (strncmp(line + sizeof last_success_metric - 1,
+				    label_pfx, sizeof label_pfx - 1) != 0)
+				continue;
+
+			if (metrics_hostname_current(line
+						+ sizeof last_success_metric
+						+ sizeof label_pfx - 2))
+				continue;
+
+			fprintf(out, "%s\n", line);
+		}
+
+		free(prev);
+	}
+
+	if (fclose(out) != 0)
+		FATAL("Failed to write file: %s: %m\n", metrics_tmp_path);
+
+	if (rename(metrics_tmp_path, metrics_path) < 0) {
+		FATAL("Failed to rename file: %s -> %s: %m\n",
+		      metrics_tmp_path, metrics_path);
+	}
+
+	DEBUG("Wrote metrics snapshot: %s\n", metrics_path);
 }
 
+
 /*******************************************************************************
  *
  *
- * 	mod_nss database file-related functions
+ * 	Arena allocator
  *
  *
  ******************************************************************************/
 
 /*
- * Copies the contents of the regular file refered to by src to the regular file
- * refered to by dest.
+ * The tree walks (copy_dir_contents and delete_dir_contents) construct a
+ * path, a name, and some bookkeeping for every directory entry.  Rather than
+ * a malloc/free round-trip per entry, each directory level draws those
+ * allocations from a bump allocator and releases them all at once when the
+ * level is done -- one malloc per region (256 KB) instead of several per
+ * entry.
  *
- * path:  The path of the source and destination files, relative to the old and
- *	  new mod_nss database directories respectively.  It must NOT begin with
- * 	  a / (and it must not be an empty string).
+ * Individual allocations are never freed, so worker pool jobs and queued
+ * io_uring operations may safely reference arena memory until the level's
+ * barrier (pool_drain or uring_flush), after which the arena is freed.
  */
-static void copy_file_contents(const int src, const int dest,
-			       const char *const restrict path,
-			       const struct stat *const restrict srcst)
+
+#define ARENA_REGION_SIZE	(256 * 1024)
+
+struct arena_region {
+	struct arena_region *next;
+	size_t size;	/* Usable bytes in buf */
+	size_t used;
+	char buf[] __attribute__((aligned(16)));
+};
+
+struct arena {
+	struct arena_region *regions;
+};
+
+#define ARENA_INIT		{ NULL }
+
+static void *arena_alloc(struct arena *const arena, size_t size)
 {
-	void *smap, *dmap;
-	struct stat st;
+	struct arena_region *region;
+	size_t region_size;
+	void *p;
 
-	assert(*path != '/' && *path != 0);
+	/* Keep subsequent allocations aligned for any type */
+	size = (size + 15) & ~(size_t)15;
 
-	if (srcst->st_size == 0)
-		return;
+	region = arena->regions;
 
-	if (srcst->st_size < 0 || srcst->st_size > SSIZE_MAX) {
-		FATAL("File size invalid: %s/%s/%s\n",
-		      httpd_conf_dir, old_dbdir_name, path);
-	}
+	if (region == NULL || region->size - region->used < size) {
 
-	if (fallocate(dest, 0, 0, srcst->st_size) < 0) {
-		FATAL("Failed to allocate file: %s/%s/%s: %m\n",
-		      httpd_conf_dir, new_dbdir_name, path);
-	}
+		region_size = ARENA_REGION_SIZE;
+		if (region_size < size)
+			region_size = size;
 
-	smap = mmap(NULL, srcst->st_size, PROT_READ, MAP_PRIVATE, src, 0);
-	if (smap == MAP_FAILED) {
-		FATAL("Failed to map file: %s/%s/%s: %m\n",
-		      httpd_conf_dir, old_dbdir_name, path);
-	}
+		region = malloc(sizeof *region + region_size);
+		if (region == NULL)
+			FATAL("Memory allocation failed: %m\n");
 
-	dmap = mmap(NULL, srcst->st_size, PROT_WRITE, MAP_SHARED, dest, 0);
-	if (dmap == MAP_FAILED) {
-		FATAL("Failed to map file: %s/%s/%s: %m\n",
-		      httpd_conf_dir, new_dbdir_name, path);
+		region->next = arena->regions;
+		region->size = region_size;
+		region->used = 0;
+		arena->regions = region;
 	}
 
-	memcpy(dmap, smap, srcst->st_size);
+	p = region->buf + region->used;
+	region->used += size;
 
-	if (munmap(smap, srcst->st_size) < 0) {
-		FATAL("Failed to unmap file: %s/%s/%s: %m\n",
-		      httpd_conf_dir, old_dbdir_name, path);
-	}
+	return p;
+}
 
-	if (munmap(dmap, srcst->st_size) < 0) {
-		FATAL("Failed to unmap file: %s/%s/%s: %m\n",
-		      httpd_conf_dir, new_dbdir_name, path);
-	}
+static char *arena_strdup(struct arena *const restrict arena,
+			  const char *const restrict s)
+{
+	size_t size;
+	char *p;
 
-	if (fstat(src, &st) < 0) {
-		FATAL("Failed to read file info: %s/%s/%s: %m\n",
-		      httpd_conf_dir, old_dbdir_name, path);
-	}
+	size = strlen(s) + 1;
+	p = arena_alloc(arena, size);
+	memcpy(p, s, size);
 
-	if (st.st_mtim.tv_sec != srcst->st_mtim.tv_sec
-			|| st.st_mtim.tv_nsec != srcst->st_mtim.tv_nsec) {
-		FATAL("File changed during copy: %s/%s/%s\n",
-		      httpd_conf_dir, old_dbdir_name, path);
+	return p;
+}
+
+static char *
+__attribute__((format(printf, 2, 3)))
+arena_printf(struct arena *const restrict arena,
+	     const char *const restrict format, ...)
+{
+	va_list ap;
+	char *p;
+	int len;
+
+	va_start(ap, format);
+	len = vsnprintf(NULL, 0, format, ap);
+	va_end(ap);
+
+	if (len < 0)
+		FATAL("Failed to format string: %m\n");
+
+	p = arena_alloc(arena, len + 1);
+
+	va_start(ap, format);
+	vsnprintf(p, len + 1, format, ap);
+	va_end(ap);
+
+	return p;
+}
+
+static void arena_free(struct arena *const arena)
+{
+	struct arena_region *region;
+
+	while ((region = arena->regions) != NULL) {
+		arena->regions = region->next;
+		free(region);
 	}
 }
 
+
+/*******************************************************************************
+ *
+ *
+ * 	Batched directory reading (getdents64)
+ *
+ *
+ ******************************************************************************/
+
 /*
- * Copies the files that make up an NSS database (cert8.db, key3.db, and
- * secmod.db) from the directory refered to by srcdir to the directory
- * refered to by destdir.  Timestamps (mtime and atime) are also copied.
+ * readdir() hands back one entry at a time from a modest buffer, so walking
+ * a large directory re-enters the kernel every few hundred entries.  The
+ * tree walks instead read raw getdents64 batches into a large buffer (drawn
+ * from the walk's arena), which cuts the syscall count for a 50k-entry
+ * directory to a handful.  The reader also exposes d_type, which lets the
+ * delete path unlink most entries without opening or stating them first.
  */
-static void copy_nssdb_files(const int srcdir, const int destdir)
+
+#define DIR_READER_BUF_SIZE	(2 * 1024 * 1024)
+
+struct dir_reader {
+	int fd;
+	size_t len;		/* Valid bytes in buf */
+	size_t pos;		/* Offset of the next entry in buf */
+	char *buf;
+	const char *dbdir_name;	/* For error messages */
+	const char *subdir;
+};
+
+/*
+ * fd must be a real (not O_PATH) descriptor for the directory; the reader
+ * advances its offset but does not take ownership of it.  The buffer comes
+ * from arena, so it is freed with the directory level.
+ */
+static void dir_reader_init(struct dir_reader *const restrict reader,
+			    struct arena *const restrict arena, const int fd,
+			    const char *const restrict dbdir_name,
+			    const char *const restrict subdir)
 {
-	static const char *const names[] = {
-		"cert8.db", "key3.db", "secmod.db", NULL
-	};
+	reader->fd = fd;
+	reader->len = 0;
+	reader->pos = 0;
+	reader->buf = arena_alloc(arena, DIR_READER_BUF_SIZE);
+	reader->dbdir_name = dbdir_name;
+	reader->subdir = subdir;
+}
 
-	struct timespec times[2];
-	const char *const *name;
-	struct stat srcst;
-	int src, dest;
+/*
+ * Returns the next directory entry, or NULL at the end of the directory.
+ * The entry points into the reader's buffer and remains valid until the
+ * next refill (at most DIR_READER_BUF_SIZE bytes of entries later).
+ */
+static struct dirent64 *dir_reader_next(struct dir_reader *const reader)
+{
+	struct dirent64 *d;
+	ssize_t len;
 
-	for (name = names; *name != NULL; ++name) {
+	if (reader->pos >= reader->len) {
 
-		src = openat(srcdir, *name, O_RDONLY | O_NOFOLLOW);
-		if (src < 0) {
-			FATAL("Failed to open file: %s/%s/%s: %m\n",
-			      httpd_conf_dir, old_dbdir_name, *name);
+		len = getdents64(reader->fd, reader->buf,
+				 DIR_READER_BUF_SIZE);
+		if (len < 0) {
+			FATAL("Failed to read directory: %s/%s%s: %m\n",
+			      httpd_conf_dir, reader->dbdir_name,
+			      reader->subdir);
 		}
+		if (len == 0)
+			return NULL;
 
-		if (fstat(src, &srcst) < 0) {
-			FATAL("Failed to read file info: %s/%s/%s: %m\n",
-			      httpd_conf_dir, old_dbdir_name, *name);
+		reader->len = len;
+		reader->pos = 0;
+	}
+
+	d = (struct dirent64 *)(reader->buf + reader->pos);
+	reader->pos += d->d_reclen;
+
+	return d;
+}
+
+
+/*******************************************************************************
+ *
+ *
+ * 	Command-line parsing
+ *
+ *
+ ******************************************************************************/
+
+#define USAGE_MESSAGE	"Usage: %s {-h} [-d|-i] [-t|-s] [-l] [-j N] [-u] " \
+				"NSS_USER {HOSTNAME ... | -n | -D | -p}\n"
+
+#define HELP_MESSAGE	USAGE_MESSAGE \
+			"  -h,  --help         show this message\n" \
+			"  -t,  --tty          log to stderr\n" \
+			"  -s,  --syslog       log to syslog\n" \
+			"  -d,  --debug        log debugging (and " \
+						"informational) messages\n" \
+			"  -i,  --info         log informational messages\n" \
+			"  -n,  --scan         process all new certificates " \
+						"in /var/lib/acme\n" \
+			"  -l,  --link         hard link unmodified files " \
+						"instead of copying\n" \
+			"  -j,  --jobs N       copy files with N worker " \
+						"threads\n" \
+			"  -u,  --uring        batch stat/unlink syscalls " \
+						"with io_uring\n" \
+			"  -D,  --daemon       watch /var/lib/acme and " \
+						"process new certificates " \
+						"as they arrive\n" \
+			"  -w,  --window SECS  daemon mode batching window " \
+						"(default 5)\n" \
+			"  -p,  --prestage     pre-stage the next database " \
+						"directory and exit\n" \
+			"  -T,  --timing       log per-phase timing as a " \
+						"JSON line\n" \
+			"  -M,  --metrics      write a Prometheus textfile " \
+						"snapshot to " \
+						"/run/update-mod-nss\n" \
+			"  -S,  --sync         flush the new database " \
+						"directory to disk before " \
+						"publishing it\n" \
+			"  -I,  --inplace      update the live SQLite " \
+						"database in place instead " \
+						"of rotating\n" \
+			"  -R,  --reload       own the httpd reload: " \
+						"debounce and issue one " \
+						"reload per renewal wave\n" \
+			"       --reload-cmd CMD    command that reloads " \
+						"httpd (default \"systemctl " \
+						"reload httpd.service\")\n" \
+			"       --reload-window SECS  reload debounce " \
+						"window (default 5)\n" \
+			"  -B,  --bench        benchmark the copy/delete " \
+						"engines in a scratch " \
+						"directory\n" \
+			"       --bench-files N     benchmark tree file " \
+						"count (default 500)\n" \
+			"       --bench-subdirs N   benchmark tree " \
+						"subdirectory count " \
+						"(default 4)\n" \
+			"       --bench-links N     benchmark tree symlink " \
+						"count (default 10)\n"
+
+static void
+__attribute__((noreturn))
+show_help(const char *const argv0)
+{
+	printf(HELP_MESSAGE, argv0 == NULL ? "(unknown)" : argv0);
+	exit(EXIT_SUCCESS);
+}
+
+static _Bool arg_matches(const char *const restrict arg,
+			 const char *const restrict short_opt,
+			 const char *const restrict long_opt)
+{
+	return (short_opt != NULL && strcmp(arg, short_opt) == 0)
+		|| (long_opt != NULL && strcmp(arg, long_opt) == 0);
+}
+
+/*
+ * Add a hostname to the list of hostnames to be processed.
+ */
+static void add_cert_hostname(const char *const hostname)
+{
+	const char **hostnames;
+
+	hostnames = realloc(cert_hostnames,
+			    (num_cert_hostnames + 1) * sizeof *cert_hostnames);
+	if (hostnames == NULL)
+		FATAL("Memory allocation failed: %m\n");
+
+	cert_hostnames = hostnames;
+	cert_hostnames[num_cert_hostnames++] = hostname;
+}
+
+static void parse_args(const int argc, char **const argv)
+{
+	_Bool allow_root = 0;
+	const char *nss_user;
+	struct passwd *pw;
+	unsigned int h;
+	int i;
+
+	/* Make an intelligent guess about where to send errors */
+	use_syslog = !isatty(fileno(stderr));
+
+	if (argc < 3) {
+		if (argc == 2 && arg_matches(argv[1], "-h", "--help"))
+			show_help(argv[0]);
+		if (!(argc == 2 && arg_matches(argv[1], "-B", "--bench"))) {
+			FATAL(USAGE_MESSAGE,
+			      argv[0] == NULL ? "(unknown)" : argv[0]);
 		}
+	}
 
-		if (!S_ISREG(srcst.st_mode)) {
-			FATAL("Not a regular file: %s/%s/%s\n",
-			      httpd_conf_dir, old_dbdir_name, *name);
+	nss_user = NULL;
+
+	for (i = 1; i < argc; ++i) {
+
+		if (arg_matches(argv[i], "-h", "--help")) {
+			show_help(argv[0]);
+		}
+		else if (arg_matches(argv[i], "-d", "--debug")) {
+			verbosity = LOG_DEBUG;
+		}
+		else if (arg_matches(argv[i], "-i", "--info")) {
+			verbosity = LOG_INFO;
+		}
+		else if (arg_matches(argv[i], "-t", "--tty")) {
+			use_syslog = 0;
+		}
+		else if (arg_matches(argv[i], "-s", "--syslog")) {
+			use_syslog = 1;
+		}
+		else if (arg_matches(argv[i], "-n", "--scan")) {
+			scan_new_certs = 1;
+		}
+		else if (arg_matches(argv[i], "-l", "--link")) {
+			hardlink_files = 1;
+		}
+		else if (arg_matches(argv[i], "-u", "--uring")) {
+			use_uring = 1;
+		}
+		else if (arg_matches(argv[i], "-D", "--daemon")) {
+			daemon_mode = 1;
 		}
+		else if (arg_matches(argv[i], "-p", "--prestage")) {
+			prestage_mode = 1;
+		}
+		else if (arg_matches(argv[i], "-T", "--timing")) {
+			show_timing = 1;
+		}
+		else if (arg_matches(argv[i], "-M", "--metrics")) {
+			metrics_mode = 1;
+		}
+		else if (arg_matches(argv[i], "-S", "--sync")) {
+			sync_mode = 1;
+		}
+		else if (arg_matches(argv[i], "-I", "--inplace")) {
+			inplace_mode = 1;
+		}
+		else if (arg_matches(argv[i], "-R", "--reload")) {
+			reload_mode = 1;
+		}
+		else if (arg_matches(argv[i], NULL, "--reload-cmd")) {
 
-		dest = openat(destdir, *name, O_RDWR | O_CREAT | O_EXCL, 0660);
-		if (dest < 0) {
-			FATAL("Failed to create file: %s/%s/%s: %m\n",
-			      httpd_conf_dir, new_dbdir_name, *name);
+			if (++i >= argc)
+				FATAL("Missing argument: %s\n", argv[i - 1]);
+
+			reload_cmd = argv[i];
 		}
+		else if (arg_matches(argv[i], NULL, "--reload-window")) {
 
-		copy_file_contents(src, dest, *name, &srcst);
+			char *end;
+			unsigned long window;
 
-		if (fchown(dest, -1, nss_gid) < 0) {
-			FATAL("Failed to change owner of file: %s/%s/%s: %m\n",
-			      httpd_conf_dir, new_dbdir_name, *name);
+			if (++i >= argc)
+				FATAL("Missing argument: %s\n", argv[i - 1]);
+
+			errno = 0; window = strtoul(argv[i], &end, 10);
+			if (errno != 0 || *end != 0 || end == argv[i]
+					|| window > 3600) {
+				FATAL("Invalid reload window: %s\n", argv[i]);
+			}
+
+			reload_window = window;
+		}
+		else if (arg_matches(argv[i], "-B", "--bench")) {
+			bench_mode = 1;
 		}
+		else if (arg_matches(argv[i], NULL, "--bench-files")
+				|| arg_matches(argv[i], NULL, "--bench-subdirs")
+				|| arg_matches(argv[i], NULL, "--bench-links")) {
+
+			char *end;
+			unsigned long value;
+
+			if (++i >= argc)
+				FATAL("Missing argument: %s\n", argv[i - 1]);
+
+			errno = 0; value = strtoul(argv[i], &end, 10);
+			if (errno != 0 || *end != 0 || end == argv[i]
+					|| value > 1000000) {
+				FATAL("Invalid count: %s\n", argv[i]);
+			}
+
+			if (strcmp(argv[i - 1], "--bench-files") == 0)
+				bench_num_files = value;
+			else if (strcmp(argv[i - 1], "--bench-subdirs") == 0)
+				bench_num_subdirs = value;
+			else
+				bench_num_links = value;
+		}
+		else if (arg_matches(argv[i], "-w", "--window")) {
 
-		if (fchmod(dest, 0660) < 0) {
-			FATAL("Failed to set permissions: %s/%s/%s: %m\n",
-			      httpd_conf_dir, new_dbdir_name, *name);
+			char *end;
+			unsigned long window;
+
+			if (++i >= argc)
+				FATAL("Missing argument: %s\n", argv[i - 1]);
+
+			errno = 0; window = strtoul(argv[i], &end, 10);
+			if (errno != 0 || *end != 0 || end == argv[i]
+					|| window > 3600) {
+				FATAL("Invalid batch window: %s\n", argv[i]);
+			}
+
+			batch_window = window;
 		}
+		else if (arg_matches(argv[i], "-j", "--jobs")) {
 
-		times[0] = srcst.st_atim;
-		times[1] = srcst.st_mtim;
+			char *end;
+			unsigned long jobs;
 
-		if (futimens(dest, times) < 0) {
-			FATAL("Failed to set timestamp: %s/%s/%s: %m\n",
-			      httpd_conf_dir, new_dbdir_name, *name);
+			if (++i >= argc)
+				FATAL("Missing argument: %s\n", argv[i - 1]);
+
+			errno = 0; jobs = strtoul(argv[i], &end, 10);
+			if (errno != 0 || *end != 0 || end == argv[i]
+					|| jobs < 1 || jobs > 128) {
+				FATAL("Invalid number of jobs: %s\n", argv[i]);
+			}
+
+			copy_jobs = jobs;
+		}
+		else if (arg_matches(argv[i], NULL, "--allow-root")) {
+			allow_root = 1;
+		}
+		else if (argv[i][0] == '-') {
+			if (!use_syslog)
+				ERROR(USAGE_MESSAGE, argv[0]);
+			FATAL("Invalid option: %s\n", argv[i]);
+		}
+		else if (nss_user == NULL) {
+			nss_user = argv[i];
 		}
+		else {
+			add_cert_hostname(argv[i]);
+		}
+	}
 
-		if (close(src) < 0) {
-			FATAL("Failed to close file: %s/%s/%s: %m\n",
-			      httpd_conf_dir, old_dbdir_name, *name);
+	if (bench_mode) {
+		if (nss_user != NULL || num_cert_hostnames != 0
+				|| scan_new_certs || daemon_mode
+				|| prestage_mode || inplace_mode) {
+			FATAL("Cannot combine --bench with other modes "
+			      "or arguments\n");
 		}
+		return;
+	}
+
+	if (nss_user == NULL) {
+		if (!use_syslog)
+			ERROR(USAGE_MESSAGE, argv[0]);
+		FATAL("No NSS user specified\n");
+	}
+
+	if (num_cert_hostnames == 0 && !scan_new_certs && !daemon_mode
+			&& !prestage_mode) {
+		if (!use_syslog)
+			ERROR(USAGE_MESSAGE, argv[0]);
+		FATAL("No hostname(s) specified "
+		      "(and --scan/--daemon/--prestage not specified)\n");
+	}
+
+	if (num_cert_hostnames != 0
+			&& (scan_new_certs || daemon_mode || prestage_mode)) {
+		FATAL("Cannot specify both hostname(s) "
+		      "and --scan/--daemon/--prestage\n");
+	}
+
+	if (inplace_mode && prestage_mode)
+		FATAL("Cannot specify both --inplace and --prestage\n");
+
+	errno = 0; pw = getpwnam(nss_user);
+	if (pw == NULL) {
+		if (errno == 0)
+			FATAL("User does not exist: %s\n", nss_user);
+		else
+			FATAL("Failed to get user info: %s: %m\n", nss_user);
+	}
+
+	nss_uid = pw->pw_uid;
+	if (nss_uid == 0 && !allow_root)
+		FATAL("NSS user is root but --allow-root not specified\n");
+
+	nss_gid = pw->pw_gid;
+	if (nss_gid == 0 && !allow_root)
+		FATAL("NSS group is root but --allow-root not specified\n");
+
+	DEBUG("  user = %s\n", pw->pw_name);
+	for (h = 0; h < num_cert_hostnames; ++h)
+		DEBUG("  hostname = %s\n", cert_hostnames[h]);
+}
+
+/*
+ * Populate the hostname list by scanning /var/lib/acme for ${HOSTNAME}.new
+ * symbolic links (--scan mode).
+ */
+static void scan_acme_cert_dir(void)
+{
+	static const char new_suffix[] = ".new";
+
+	struct dirent *d;
+	char *hostname, *crt;
+	unsigned int h;
+	size_t len;
+	DIR *dir;
+
+	dir = opendir(acme_cert_dir);
+	if (dir == NULL)
+		FATAL("Failed to open directory: %s: %m\n", acme_cert_dir);
+
+	while ((errno = 0, d = readdir(dir)) != NULL) {
+
+		len = strlen(d->d_name);
+		if (len <= sizeof new_suffix - 1)
+			continue;
+		if (strcmp(d->d_name + len - (sizeof new_suffix - 1),
+			   new_suffix) != 0) {
+			continue;
+		}
+
+		hostname = strndup(d->d_name, len - (sizeof new_suffix - 1));
+		if (hostname == NULL)
+			FATAL("Memory allocation failed: %m\n");
+
+		/* Skip hostnames that are already in the list */
+		for (h = 0; h < num_cert_hostnames; ++h) {
+			if (strcmp(cert_hostnames[h], hostname) == 0)
+				break;
+		}
+		if (h < num_cert_hostnames) {
+			free(hostname);
+			continue;
+		}
+
+		/* A dangling *.new symlink must not abort the whole batch */
+		if (asprintf(&crt, "%s/%s.crt", acme_cert_dir, hostname) < 0) {
+			FATAL("Failed to format path: %s/%s.crt: %m\n",
+			      acme_cert_dir, hostname);
+		}
+		if (access(crt, R_OK) < 0) {
+			WARN("Ignoring %s/%s: no certificate file: %s\n",
+			     acme_cert_dir, d->d_name, crt);
+			free(crt);
+			free(hostname);
+			continue;
+		}
+		free(crt);
+
+		DEBUG("  found new certificate: %s/%s\n",
+		      acme_cert_dir, d->d_name);
+
+		add_cert_hostname(hostname);
+	}
+	if (errno != 0)
+		FATAL("Failed to read directory: %s: %m\n", acme_cert_dir);
+
+	if (closedir(dir) < 0) {
+		FATAL("Failed to close directory stream: %s: %m\n",
+		      acme_cert_dir);
+	}
+}
+
+
+/*******************************************************************************
+ *
+ *
+ * 	mod_nss database directories
+ *
+ *
+ ******************************************************************************/
+
+/*
+ * Finds the existing mod_nss database directory (by following the
+ * /etc/httpd/alias symlink).  Also populates old_nssdb_dir.
+ *
+ * Returns a file descriptor that refers to the existing directory.  Link info
+ * is returned via linkst.
+ */
+static int old_nssdb_dir(const int httpd_conf_dirfd, struct stat *const linkst)
+{
+	int fd;
+
+	fd = openat(httpd_conf_dirfd, "alias", O_RDONLY | O_NOFOLLOW | O_PATH);
+	if (fd < 0) {
+		FATAL("Failed to open symbolic link: %s/alias: %m\n",
+		      httpd_conf_dir);
+	}
+
+	if (fstat(fd, linkst) < 0) {
+		FATAL("Failed to read symbolic link info: %s/alias: %m\n",
+		      httpd_conf_dir);
+	}
+
+	if (!S_ISLNK(linkst->st_mode))
+		FATAL("Not a symbolic link: %s/alias\n", httpd_conf_dir);
+
+	if (linkst->st_size > (off_t)NSSDB_DIR_PTN_LEN) {
+		FATAL("Symbolic link target too long: %s/alias\n",
+		      httpd_conf_dir);
+	}
+
+	memset(old_dbdir_name, 0, NSSDB_DIR_PTN_SIZE);
+
+	if (readlinkat(fd, "", old_dbdir_name, NSSDB_DIR_PTN_LEN) < 0) {
+		FATAL("Failed to read symbolic link target: %s/alias: %m\n",
+		      httpd_conf_dir);
+	}
+
+	if (memchr(old_dbdir_name, '/', NSSDB_DIR_PTN_LEN) != NULL) {
+		FATAL("Symbolic link target invalid: %s/alias -> %s\n",
+		      httpd_conf_dir, old_dbdir_name);
+	}
+
+	if (close(fd) < 0) {
+		FATAL("Failed to close symbolic link: %s/alias: %m\n",
+		      httpd_conf_dir);
+	}
+
+	fd = openat(httpd_conf_dirfd, old_dbdir_name,
+		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd < 0) {
+		FATAL("Failed to open directory: %s/%s: %m\n",
+		      httpd_conf_dir, old_dbdir_name);
+	}
+
+	/* A cert9.db means the database uses the SQLite (sql:) backend */
+	if (faccessat(fd, "cert9.db", F_OK, 0) == 0) {
+		nssdb_sql = 1;
+		nssdb_file_names = nssdb_sql_file_names;
+		DEBUG("Database uses the SQLite (cert9) backend\n");
+	}
+	else if (errno != ENOENT) {
+		FATAL("Failed to check for file: %s/%s/cert9.db: %m\n",
+		      httpd_conf_dir, old_dbdir_name);
+	}
+
+	return fd;
+}
+
+/*
+ * Create a directory for the new copy of the mod_nss database.  Also populates
+ * new_dbdir_name.
+ *
+ * Returns a file descriptor that refers to the new directory.
+ */
+static int new_nssdb_dir(const int httpd_conf_dirfd)
+{
+	/* Points to the timestamp in new_dbdir_name */
+	static char *const new_dbdir_name_ts =
+					new_dbdir_name + NSSDB_DIR_PFX_LEN;
+
+	struct timespec now;
+	unsigned int msec, attempt;
+	struct tm *tm;
+	int dirfd;
+
+	if (clock_gettime(CLOCK_REALTIME, &now) < 0)
+		FATAL("Failed to read realtime clock: %m\n");
+
+	tm = gmtime(&now.tv_sec);
+
+	/* Am I being too optimistic? */
+	if (tm->tm_year > 9999 - 1900) {
+		FATAL("This program is not supported in the year %d\n",
+		      tm->tm_year + 1900);
+	}
+
+	memcpy(new_dbdir_name, NSSDB_DIR_PREFIX, NSSDB_DIR_PFX_LEN);
+
+	if (strftime(new_dbdir_name_ts,
+		     NSSDB_DIR_TS_SIZE - NSSDB_DIR_MSEC_LEN, "%Y%m%d%H%M%S",
+		     tm) != NSSDB_DIR_TS_LEN - NSSDB_DIR_MSEC_LEN)  {
+		FATAL("Failed to format timestamp (%lld)\n",
+		      (long long)now.tv_sec);
+	}
+
+	/*
+	 * The millisecond component makes back-to-back rotations (batch and
+	 * daemon modes) collide only within the same millisecond; a
+	 * collision bumps the component until a free name is found.
+	 */
+	msec = now.tv_nsec / 1000000;
+
+	for (attempt = 0; attempt < 1000; ++attempt) {
+
+		snprintf(new_dbdir_name_ts + NSSDB_DIR_TS_LEN
+							- NSSDB_DIR_MSEC_LEN,
+			 NSSDB_DIR_MSEC_LEN + 1, "%03u", msec);
+
+		if (mkdirat(httpd_conf_dirfd, new_dbdir_name, 0750) == 0)
+			break;
+
+		if (errno != EEXIST) {
+			FATAL("Failed to create directory: %s/%s: %m\n",
+			      httpd_conf_dir, new_dbdir_name);
+		}
+
+		msec = (msec + 1) % 1000;
+	}
+
+	if (attempt == 1000) {
+		FATAL("Failed to create directory: %s/%s: all names in "
+		      "use\n", httpd_conf_dir, new_dbdir_name);
+	}
+
+	dirfd = openat(httpd_conf_dirfd, new_dbdir_name,
+		       O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (dirfd < 0) {
+		FATAL("Failed to open directory: %s/%s: %m\n",
+		      httpd_conf_dir, new_dbdir_name);
+	}
+
+	if (fchownat(dirfd, "", -1, nss_gid, AT_EMPTY_PATH) < 0) {
+		FATAL("Failed to change owner of directory: %s/%s: %m\n",
+		      httpd_conf_dir, new_dbdir_name);
+	}
+
+	return dirfd;
+}
+
+/*
+ * Serialize concurrent instances (the per-domain systemd template can start
+ * several at once) with an exclusive flock on a lock file in the httpd
+ * configuration directory.
+ *
+ * Returns a file descriptor holding the lock; closing it releases the lock.
+ */
+static int lock_httpd_conf_dir(const int httpd_conf_dirfd)
+{
+	int fd;
+
+	fd = openat(httpd_conf_dirfd, lock_file_name,
+		    O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		FATAL("Failed to create lock file: %s/%s: %m\n",
+		      httpd_conf_dir, lock_file_name);
+	}
+
+	if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+		return fd;
+
+	if (errno != EWOULDBLOCK) {
+		FATAL("Failed to lock file: %s/%s: %m\n",
+		      httpd_conf_dir, lock_file_name);
+	}
+
+	INFO("Waiting for concurrent instance to finish\n");
+
+	if (flock(fd, LOCK_EX) < 0) {
+		FATAL("Failed to lock file: %s/%s: %m\n",
+		      httpd_conf_dir, lock_file_name);
+	}
+
+	return fd;
+}
+
+/*******************************************************************************
+ *
+ *
+ * 	mod_nss database file-related functions
+ *
+ *
+ ******************************************************************************/
+
+/*
+ * See copy_file_contents().
+ *
+ * Copies the contents of the regular file refered to by src to the regular
+ * file refered to by dest without moving the data through this process's
+ * address space.  A FICLONE ioctl (a "reflink," which shares the source
+ * file's extents and writes no data at all) is attempted first; if the
+ * filesystem cannot clone the file, the data is copied in the kernel with
+ * copy_file_range().
+ *
+ * Only data extents (enumerated with lseek SEEK_DATA/SEEK_HOLE) are copied.
+ * The destination gets its logical size from ftruncate up front, so holes in
+ * a sparse source stay holes instead of being materialized on every
+ * rotation.  If the filesystem cannot report holes, the whole file is
+ * treated as one data extent.
+ *
+ * Returns 0 if the contents were fully copied.  Returns -1 if neither
+ * mechanism is supported (old kernel, filesystem, or a cross-device copy),
+ * in which case the caller must fall back to the mmap path.
+ */
+static int copy_file_kernel(const int src, const int dest,
+			    const char *const restrict path,
+			    const struct stat *const restrict srcst)
+{
+	off_t data, hole, pos_in, pos_out;
+	ssize_t copied;
+	_Bool any;
+
+	if (ioctl(dest, FICLONE, src) == 0) {
+		DEBUG("  cloned file (FICLONE): %s/%s/%s\n",
+		      httpd_conf_dir, new_dbdir_name, path);
+		return 0;
+	}
+
+	/* Cloning is purely opportunistic; any failure falls through */
+
+	if (ftruncate(dest, srcst->st_size) < 0) {
+		FATAL("Failed to set file size: %s/%s/%s: %m\n",
+		      httpd_conf_dir, new_dbdir_name, path);
+	}
+
+	any = 0;
+	data = 0;
+
+	while (data < srcst->st_size) {
+
+		data = lseek(src, data, SEEK_DATA);
+		if (data < 0) {
+
+			if (errno == ENXIO)
+				break;	/* Nothing but a hole remains */
+
+			if (errno != EINVAL) {
+				FATAL("Failed to find data extent: "
+				      "%s/%s/%s: %m\n",
+				      httpd_conf_dir, old_dbdir_name, path);
+			}
+
+			/* No SEEK_DATA support; treat the file as all data */
+			data = 0;
+			hole = srcst->st_size;
+		}
+		else {
+			hole = lseek(src, data, SEEK_HOLE);
+			if (hole < 0) {
+				FATAL("Failed to find hole: %s/%s/%s: %m\n",
+				      httpd_conf_dir, old_dbdir_name, path);
+			}
+		}
+
+		pos_in = data;
+		pos_out = data;
+
+		while (pos_in < hole) {
+
+			copied = copy_file_range(src, &pos_in, dest, &pos_out,
+						 hole - pos_in, 0);
+			if (copied < 0) {
+
+				/*
+				 * If nothing has been copied yet, the mmap
+				 * path can still be used.  A failure mid-copy
+				 * is fatal.
+				 */
+				if (!any && (errno == EINVAL
+						|| errno == EXDEV
+						|| errno == ENOSYS
+						|| errno == EOPNOTSUPP
+						|| errno == EBADF)) {
+					return -1;
+				}
+
+				FATAL("Failed to copy file contents: "
+				      "%s/%s/%s: %m\n",
+				      httpd_conf_dir, old_dbdir_name, path);
+			}
+
+			if (copied == 0) {
+				FATAL("File truncated during copy: "
+				      "%s/%s/%s\n",
+				      httpd_conf_dir, old_dbdir_name, path);
+			}
+
+			any = 1;
+		}
+
+		data = hole;
+	}
+
+	return 0;
+}
+
+/*
+ * Files at or above this size get explicit readahead and page cache hints
+ * during the copy; see copy_file_contents().
+ */
+#define COPY_HINT_THRESHOLD	(256 * 1024)
+
+/*
+ * Copies the contents of the regular file refered to by src to the regular file
+ * refered to by dest.
+ *
+ * path:  The path of the source and destination files, relative to the old and
+ *	  new mod_nss database directories respectively.  It must NOT begin with
+ * 	  a / (and it must not be an empty string).
+ */
+static void copy_file_contents(const int src, const int dest,
+			       const char *const restrict path,
+			       const struct stat *const restrict srcst)
+{
+	void *smap, *dmap;
+	struct stat st;
+	_Bool large;
+	int err;
+
+	assert(*path != '/' && *path != 0);
+
+	if (srcst->st_size == 0)
+		return;
+
+	if (srcst->st_size < 0 || srcst->st_size > SSIZE_MAX) {
+		FATAL("File size invalid: %s/%s/%s\n",
+		      httpd_conf_dir, old_dbdir_name, path);
+	}
+
+	/*
+	 * Large files (the NSS databases) are read strictly sequentially, so
+	 * tell the kernel to read ahead aggressively.  Hints are advisory;
+	 * their failure doesn't abort the rotation.
+	 */
+
+	large = srcst->st_size >= COPY_HINT_THRESHOLD;
+
+	if (large) {
+		err = posix_fadvise(src, 0, srcst->st_size,
+				    POSIX_FADV_SEQUENTIAL);
+		if (err != 0) {
+			WARN("Failed to set readahead hint: %s/%s/%s: %s\n",
+			     httpd_conf_dir, old_dbdir_name, path,
+			     strerror(err));
+		}
+	}
+
+	if (copy_file_kernel(src, dest, path, srcst) == 0)
+		goto copied;
+
+	if (fallocate(dest, 0, 0, srcst->st_size) < 0) {
+		FATAL("Failed to allocate file: %s/%s/%s: %m\n",
+		      httpd_conf_dir, new_dbdir_name, path);
+	}
+
+	smap = mmap(NULL, srcst->st_size, PROT_READ,
+		    MAP_PRIVATE | (large ? MAP_POPULATE : 0), src, 0);
+	if (smap == MAP_FAILED) {
+		FATAL("Failed to map file: %s/%s/%s: %m\n",
+		      httpd_conf_dir, old_dbdir_name, path);
+	}
+
+	if (large && madvise(smap, srcst->st_size, MADV_SEQUENTIAL) < 0) {
+		WARN("Failed to set access hint: %s/%s/%s: %m\n",
+		     httpd_conf_dir, old_dbdir_name, path);
+	}
+
+	dmap = mmap(NULL, srcst->st_size, PROT_WRITE, MAP_SHARED, dest, 0);
+	if (dmap == MAP_FAILED) {
+		FATAL("Failed to map file: %s/%s/%s: %m\n",
+		      httpd_conf_dir, new_dbdir_name, path);
+	}
+
+	memcpy(dmap, smap, srcst->st_size);
+
+	if (munmap(smap, srcst->st_size) < 0) {
+		FATAL("Failed to unmap file: %s/%s/%s: %m\n",
+		      httpd_conf_dir, old_dbdir_name, path);
+	}
+
+	if (munmap(dmap, srcst->st_size) < 0) {
+		FATAL("Failed to unmap file: %s/%s/%s: %m\n",
+		      httpd_conf_dir, new_dbdir_name, path);
+	}
+
+copied:
+	if (fstat(src, &st) < 0) {
+		FATAL("Failed to read file info: %s/%s/%s: %m\n",
+		      httpd_conf_dir, old_dbdir_name, path);
+	}
+
+	if (st.st_mtim.tv_sec != srcst->st_mtim.tv_sec
+			|| st.st_mtim.tv_nsec != srcst->st_mtim.tv_nsec) {
+		FATAL("File changed during copy: %s/%s/%s\n",
+		      httpd_conf_dir, old_dbdir_name, path);
+	}
+
+	/*
+	 * The copied pages won't be read again by this process, so drop them
+	 * from the page cache rather than letting the copy evict pages httpd
+	 * is actually serving from.
+	 */
+	if (large) {
+		err = posix_fadvise(src, 0, srcst->st_size,
+				    POSIX_FADV_DONTNEED);
+		if (err == 0) {
+			err = posix_fadvise(dest, 0, srcst->st_size,
+					    POSIX_FADV_DONTNEED);
+		}
+		if (err != 0) {
+			WARN("Failed to release cached pages: %s/%s/%s: %s\n",
+			     httpd_conf_dir, new_dbdir_name, path,
+			     strerror(err));
+		}
+	}
+
+	TIMING_COUNT(timing_bytes_copied, (uint64_t)srcst->st_size);
+}
+
+/*
+ * Copies the files that make up an NSS database (cert8.db, key3.db, and
+ * secmod.db) from the directory refered to by srcdir to the directory
+ * refered to by destdir.  Timestamps (mtime and atime) are also copied.
+ */
+static void copy_nssdb_files(const int srcdir, const int destdir)
+{
+	struct timespec times[2];
+	const char *const *name;
+	struct stat srcst;
+	int src, dest;
+
+	for (name = nssdb_file_names; *name != NULL; ++name) {
+
+		src = openat(srcdir, *name, O_RDONLY | O_NOFOLLOW);
+		if (src < 0) {
+			FATAL("Failed to open file: %s/%s/%s: %m\n",
+			      httpd_conf_dir, old_dbdir_name, *name);
+		}
+
+		if (fstat(src, &srcst) < 0) {
+			FATAL("Failed to read file info: %s/%s/%s: %m\n",
+			      httpd_conf_dir, old_dbdir_name, *name);
+		}
+
+		if (!S_ISREG(srcst.st_mode)) {
+			FATAL("Not a regular file: %s/%s/%s\n",
+			      httpd_conf_dir, old_dbdir_name, *name);
+		}
+
+		dest = openat(destdir, *name, O_RDWR | O_CREAT | O_EXCL, 0660);
+		if (dest < 0) {
+			FATAL("Failed to create file: %s/%s/%s: %m\n",
+			      httpd_conf_dir, new_dbdir_name, *name);
+		}
+
+		copy_file_contents(src, dest, *name, &srcst);
+
+		if (fchown(dest, -1, nss_gid) < 0) {
+			FATAL("Failed to change owner of file: %s/%s/%s: %m\n",
+			      httpd_conf_dir, new_dbdir_name, *name);
+		}
+
+		if (fchmod(dest, 0660) < 0) {
+			FATAL("Failed to set permissions: %s/%s/%s: %m\n",
+			      httpd_conf_dir, new_dbdir_name, *name);
+		}
+
+		times[0] = srcst.st_atim;
+		times[1] = srcst.st_mtim;
+
+		if (futimens(dest, times) < 0) {
+			FATAL("Failed to set timestamp: %s/%s/%s: %m\n",
+			      httpd_conf_dir, new_dbdir_name, *name);
+		}
+
+		if (close(src) < 0) {
+			FATAL("Failed to close file: %s/%s/%s: %m\n",
+			      httpd_conf_dir, old_dbdir_name, *name);
+		}
+
+		if (close(dest) < 0) {
+			FATAL("Failed to close file: %s/%s/%s: %m\n",
+			      httpd_conf_dir, new_dbdir_name, *name);
+		}
+	}
+}
+
+/* Large enough for any file descriptor */
+#define PROC_FD_PATH_SIZE	(sizeof "/proc/self/fd/" + 10)
+
+/*
+ * Duplicate a (real, readable) directory descriptor for use as an
+ * independent directory stream.  dup() shares the file offset with the
+ * original descriptor, so rewind it; the original is only ever used as an
+ * openat()-family anchor, which ignores the offset.  Unlike a procfs reopen,
+ * this is a single cheap syscall and doesn't hit path resolution at all.
+ */
+static int dup_fd(const int orig)
+{
+	int fd;
+
+	fd = dup(orig);
+	if (fd < 0)
+		FATAL("Failed to duplicate file descriptor: %m\n");
+
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		FATAL("Failed to rewind directory stream: %m\n");
+
+	return fd;
+}
+
+/*
+ * Upgrade an O_PATH descriptor to a real descriptor.  There is no direct way
+ * to do this (openat2() doesn't accept an empty path), so reopen the
+ * descriptor's procfs link.  Only used where nothing but the O_PATH
+ * descriptor is guaranteed to still exist -- i.e. in pool workers, which may
+ * run after the walker has moved on from the entry's parent directory.
+ */
+static int reopen_fd(const int orig, const int flags)
+{
+	char path[PROC_FD_PATH_SIZE];
+	int fd;
+
+	snprintf(path, sizeof path, "/proc/self/fd/%d", orig);
+
+	fd = open(path, flags);
+	if (fd < 0)
+		FATAL("Failed to open file: %s: %m\n", path);
+
+	return fd;
+}
+
+/*
+ * Create a new symbolic link and return a file descriptor that refers to it.
+ *
+ * path:	The path of the symbolic link to be created, relative to
+ *		either old_nssdb_dir, new_nssdb_dir, or httpd_conf_dir.  If
+ * 		dbdir_name is an empty string, path must NOT begin with a /;
+ * 		otherwise it MUST begin with a slash.  In either case, it must
+ * 		not be an empty string.
+ *
+ * name:	The name of the symbolic link to be created.  (path always ends
+ * 		with name.)
+ *
+ * dbdir_name:  The name of the directory (under httpd_conf_dir) relative to
+ * 		which path is interpreted -- either old_dbdir_name,
+ * 		new_dbdir_name, or an empty string which indicates that the
+ * 		symbolic link is being created in httpd_conf_dir itself.
+ */
+static int create_symlink(const int dirfd,
+			  const char *const restrict target,
+			  const char *const restrict name,
+			  const char *const restrict dbdir_name,
+			  const char *const restrict path)
+{
+	char *new_target;
+	struct stat st;
+	int fd;
+
+	if (*dbdir_name == 0)
+		assert(*path != '/' && *path != 0);
+	else
+		assert(path[0] == '/' && path[1] != 0);
+
+	if (symlinkat(target, dirfd, name) < 0) {
+		FATAL("Failed to create symbolic link: %s/%s%s: %m\n",
+		      httpd_conf_dir, dbdir_name, path);
+	}
+
+	fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_PATH);
+	if (fd < 0) {
+		FATAL("Failed to open symbolic link: %s/%s%s: %m\n",
+		      httpd_conf_dir, dbdir_name, path);
+	}
+
+	if (fstat(fd, &st) < 0) {
+		FATAL("Failed to read symbolic link info: %s/%s%s: %m\n",
+		      httpd_conf_dir, dbdir_name, path);
+	}
+
+	if (!S_ISLNK(st.st_mode)) {
+		FATAL("Not a symbolic link: %s/%s%s\n",
+		      httpd_conf_dir, dbdir_name, path);
+	}
+
+	if (st.st_size <= 0 || st.st_size > SSIZE_MAX - 1) {
+		FATAL("Symbolic link target size invalid: %s/%s%s\n",
+		      httpd_conf_dir, dbdir_name, path);
+	}
+
+	if ((size_t)st.st_size != strlen(target)) {
+		FATAL("Symbolic link target changed: %s/%s%s\n",
+		      httpd_conf_dir, dbdir_name, path);
+	}
+
+	new_target = malloc(st.st_size + 1);
+	if (new_target == NULL)
+		FATAL("Memory allocation failed: %m\n");
+
+	memset(new_target, 0, st.st_size + 1);
+
+	if (readlinkat(fd, "", new_target, st.st_size) < 0) {
+		FATAL("Failed to read symbolic link target: %s/%s%s: %m\n",
+		      httpd_conf_dir, dbdir_name, path);
+	}
+
+	if (memcmp(target, new_target, st.st_size) != 0) {
+		FATAL("Symbolic link target changed: %s/%s%s: %m\n",
+		      httpd_conf_dir, dbdir_name, path);
+	}
+
+	free(new_target);
+
+	return fd;
+}
+
+/*
+ * Copy ownership, permissions, and (optionally) timestamps from src to dest.
+ * (Permissions are not copied for symbolic links.)
+ *
+ * path:  The path of the source and destination files, relative to the old and
+ *	  new mod_nss database directories respectively.  It MUST begin with a /
+ * 	  or be an empty string.
+ */
+static void copy_metadata(const int dest,
+			  const char *const restrict path,
+			  const struct stat *const restrict srcst,
+			  const _Bool copy_timestamps)
+{
+	char dproc[PROC_FD_PATH_SIZE];
+	struct timespec times[2];
+
+	assert(*path == '/' || *path == 0);
+
+	if (fchownat(dest, "", srcst->st_uid, srcst->st_gid, AT_EMPTY_PATH)
+			< 0) {
+		FATAL("Failed to set ownership: %s/%s%s: %m\n",
+		      httpd_conf_dir, new_dbdir_name, path);
+	}
+
+	if (!S_ISLNK(srcst->st_mode)) {
+
+		/*
+		 * Since the source isn't a symlink, dest isn't an O_PATH
+		 * file descriptor, and fchmod will work.
+		 */
+		if (fchmod(dest, srcst->st_mode & 07777) < 0) {
+			FATAL("Failed to set permissions: %s/%s%s: %m\n",
+				httpd_conf_dir, new_dbdir_name, path);
+		}
+	}
+
+	if (copy_timestamps) {
+
+		/*
+		 * utimensat doesn't accept AT_EMPTY_PATH, so use the link
+		 * in /proc/self/fd/ to achieve the desired effect.
+		 */
+		snprintf(dproc, sizeof dproc, "/proc/self/fd/%d", dest);
+
+		times[0] = srcst->st_atim;
+		times[1] = srcst->st_mtim;
+
+		if (utimensat(-1, dproc, times, 0) < 0) {
+			FATAL("Failed to set timestamp: %s/%s%s: %m\n",
+				httpd_conf_dir, new_dbdir_name, path);
+		}
+	}
+}
+
+/*
+ * --sync: nothing below ever fsyncs, so after a crash the alias symlink
+ * rename can reach disk before the database files it points to, leaving the
+ * host serving a truncated cert8.db.  Rather than a per-file fsync (which
+ * would serialize the whole copy), one syncfs() barrier flushes the fully
+ * populated directory before it is published ...
+ */
+static void sync_new_nssdb_dir(const int new_nssdb_dirfd)
+{
+	if (!sync_mode)
+		return;
+
+	if (syncfs(new_nssdb_dirfd) < 0) {
+		FATAL("Failed to sync filesystem: %s/%s: %m\n",
+		      httpd_conf_dir, new_dbdir_name);
+	}
+
+	DEBUG("Flushed filesystem containing %s/%s\n",
+	      httpd_conf_dir, new_dbdir_name);
+}
+
+/*
+ * ... and one fsync() of /etc/httpd makes the symlink rename itself
+ * durable.
+ */
+static void sync_httpd_conf_dir(const int httpd_conf_dirfd)
+{
+	if (!sync_mode)
+		return;
+
+	if (fsync(httpd_conf_dirfd) < 0)
+		FATAL("Failed to sync directory: %s: %m\n", httpd_conf_dir);
+}
+
+/*
+ * Atomically update the /etc/httpd/alias symlink.
+ */
+static void update_nssdb_symlink(const int httpd_conf_dirfd,
+				 const struct stat *const restrict linkst)
+{
+	int fd;
+
+	fd = create_symlink(httpd_conf_dirfd, new_dbdir_name,
+			    "alias.new", "", "alias.new");
+
+	if (fchownat(fd, "", linkst->st_uid, linkst->st_gid, AT_EMPTY_PATH)
+			< 0) {
+		FATAL("Failed to set symbolic link ownership: "
+		      "%s/alias.new: %m\n",
+		      httpd_conf_dir);
+	}
+
+	if (close(fd) < 0) {
+		FATAL("Failed to close symbolic link: %s/alias.new: %m\n",
+		      httpd_conf_dir);
+	}
+
+	if (renameat(httpd_conf_dirfd, "alias.new", httpd_conf_dirfd, "alias")
+			< 0) {
+		FATAL("Failed to rename symbolic link: "
+		      "%s/alias.new to %s/alias: %m\n",
+		      httpd_conf_dir, httpd_conf_dir);
+	}
+}
+
+
+/*******************************************************************************
+ *
+ *
+ * 	io_uring syscall batching (--uring)
+ *
+ *
+ ******************************************************************************/
+
+/*
+ * Both tree walks (copy_dir_contents and delete_dir_contents) issue long
+ * chains of per-entry stat and unlink syscalls.  With --uring, those
+ * operations are instead queued as submission queue entries and submitted to
+ * the kernel in batches of up to URING_QUEUE_DEPTH, cutting the number of
+ * kernel entries per directory from O(entries) to O(entries / batch size).
+ *
+ * The ring is driven directly with the io_uring_setup/io_uring_enter
+ * syscalls (no liburing dependency), and only ever used from the walking
+ * thread.  If the kernel does not support io_uring (or the required
+ * opcodes), use_uring is cleared and the synchronous paths are used.
+ */
+
+#define URING_QUEUE_DEPTH	256
+#define URING_PROBE_OPS		(IORING_OP_UNLINKAT + 1)
+
+/*
+ * Per-operation bookkeeping, indexed by the operation's position in the
+ * current batch (which is also stored in the SQE's user_data).  verb and
+ * path are used to construct the error message if the operation fails.
+ * name and path are owned by the caller (normally a directory level's
+ * arena), which must keep them valid until the batch is flushed.
+ */
+struct uring_op {
+	const char *verb;
+	const char *dbdir;
+	const char *name;
+	const char *path;
+};
+
+static int uring_fd = -1;
+static struct io_uring_params uring_params;
+
+static unsigned char *uring_sq_ring;
+static struct io_uring_sqe *uring_sqes;
+static unsigned char *uring_cq_ring;
+
+static unsigned int *uring_sq_tail;
+static unsigned int *uring_sq_mask;
+static unsigned int *uring_sq_array;
+static unsigned int *uring_cq_head;
+static unsigned int *uring_cq_mask;
+static struct io_uring_cqe *uring_cqes;
+
+static struct uring_op uring_ops[URING_QUEUE_DEPTH];
+static unsigned int uring_queued;
+
+/*
+ * Does the kernel support the opcodes the walkers submit?  io_uring gained
+ * STATX in Linux 5.6 and UNLINKAT in 5.11; on older kernels an unsupported
+ * opcode only surfaces as an -EINVAL completion mid-walk, so probe up front.
+ * IORING_REGISTER_PROBE itself is missing before 5.6, which the kernel
+ * reports as EINVAL -- treated here as "not supported".
+ */
+static _Bool uring_opcodes_supported(void)
+{
+	union {
+		struct io_uring_probe probe;
+		unsigned char bytes[sizeof(struct io_uring_probe)
+				    + URING_PROBE_OPS
+					* sizeof(struct io_uring_probe_op)];
+	} u;
+
+	memset(&u, 0, sizeof u);
+
+	if (syscall(SYS_io_uring_register, uring_fd, IORING_REGISTER_PROBE,
+		    &u.probe, URING_PROBE_OPS) < 0) {
+		if (errno == EINVAL)
+			return 0;
+		FATAL("Failed to probe io_uring opcodes: %m\n");
+	}
+
+	return IORING_OP_STATX < u.probe.ops_len
+		&& (u.probe.ops[IORING_OP_STATX].flags
+			& IO_URING_OP_SUPPORTED)
+		&& IORING_OP_UNLINKAT < u.probe.ops_len
+		&& (u.probe.ops[IORING_OP_UNLINKAT].flags
+			& IO_URING_OP_SUPPORTED);
+}
+
+/*
+ * Create the ring and map the submission/completion queues.  Clears
+ * use_uring (falling back to the synchronous paths) if the kernel does not
+ * support io_uring or the required opcodes.
+ */
+static void uring_setup(void)
+{
+	size_t size;
+
+	memset(&uring_params, 0, sizeof uring_params);
+
+	uring_fd = syscall(SYS_io_uring_setup, URING_QUEUE_DEPTH,
+			   &uring_params);
+	if (uring_fd < 0) {
+		if (errno == ENOSYS || errno == EPERM || errno == EINVAL) {
+			NOTICE("io_uring not available; "
+			       "using synchronous syscalls: %m\n");
+			use_uring = 0;
+			return;
+		}
+		FATAL("Failed to create io_uring: %m\n");
+	}
+
+	if (!uring_opcodes_supported()) {
+		NOTICE("io_uring STATX/UNLINKAT not supported; "
+		       "using synchronous syscalls\n");
+		if (close(uring_fd) < 0)
+			FATAL("Failed to close io_uring: %m\n");
+		uring_fd = -1;
+		use_uring = 0;
+		return;
+	}
+
+	size = uring_params.sq_off.array
+			+ uring_params.sq_entries * sizeof(unsigned int);
+	uring_sq_ring = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, uring_fd,
+			     IORING_OFF_SQ_RING);
+	if (uring_sq_ring == MAP_FAILED)
+		FATAL("Failed to map io_uring submission queue: %m\n");
+
+	size = uring_params.sq_entries * sizeof(struct io_uring_sqe);
+	uring_sqes = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, uring_fd,
+			  IORING_OFF_SQES);
+	if (uring_sqes == MAP_FAILED)
+		FATAL("Failed to map io_uring submission entries: %m\n");
+
+	size = uring_params.cq_off.cqes
+			+ uring_params.cq_entries * sizeof(struct io_uring_cqe);
+	uring_cq_ring = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, uring_fd,
+			     IORING_OFF_CQ_RING);
+	if (uring_cq_ring == MAP_FAILED)
+		FATAL("Failed to map io_uring completion queue: %m\n");
+
+	uring_sq_tail = (unsigned int *)
+			(uring_sq_ring + uring_params.sq_off.tail);
+	uring_sq_mask = (unsigned int *)
+			(uring_sq_ring + uring_params.sq_off.ring_mask);
+	uring_sq_array = (unsigned int *)
+			(uring_sq_ring + uring_params.sq_off.array);
+	uring_cq_head = (unsigned int *)
+			(uring_cq_ring + uring_params.cq_off.head);
+	uring_cq_mask = (unsigned int *)
+			(uring_cq_ring + uring_params.cq_off.ring_mask);
+	uring_cqes = (struct io_uring_cqe *)
+			(uring_cq_ring + uring_params.cq_off.cqes);
+
+	DEBUG("io_uring created: %u submission queue entries\n",
+	      uring_params.sq_entries);
+}
+
+/*
+ * Unmap the queues and close the ring.  Used by the trash purge child,
+ * which inherits the parent's ring across fork() but must not share it --
+ * the MAP_SHARED head/tail indices and uring_ops[] bookkeeping have no
+ * cross-process synchronization.
+ */
+static void uring_teardown(void)
+{
+	size_t size;
+
+	size = uring_params.sq_off.array
+			+ uring_params.sq_entries * sizeof(unsigned int);
+	if (munmap(uring_sq_ring, size) < 0)
+		FATAL("Failed to unmap io_uring submission queue: %m\n");
+
+	size = uring_params.sq_entries * sizeof(struct io_uring_sqe);
+	if (munmap(uring_sqes, size) < 0)
+		FATAL("Failed to unmap io_uring submission entries: %m\n");
+
+	size = uring_params.cq_off.cqes
+			+ uring_params.cq_entries * sizeof(struct io_uring_cqe);
+	if (munmap(uring_cq_ring, size) < 0)
+		FATAL("Failed to unmap io_uring completion queue: %m\n");
+
+	if (close(uring_fd) < 0)
+		FATAL("Failed to close io_uring: %m\n");
+
+	uring_fd = -1;
+}
+
+/*
+ * Submit all queued operations, wait for them to complete, and check their
+ * results.  Any failed operation is fatal (matching the synchronous paths).
+ */
+static void uring_flush(void)
+{
+	const struct io_uring_cqe *cqe;
+	const struct uring_op *op;
+	unsigned int i, tail, head;
+	long submitted;
+
+	if (uring_queued == 0)
+		return;
+
+	tail = *uring_sq_tail;
+
+	for (i = 0; i < uring_queued; ++i)
+		uring_sq_array[(tail + i) & *uring_sq_mask] = i;
+
+	__atomic_store_n(uring_sq_tail, tail + uring_queued, __ATOMIC_RELEASE);
+
+	submitted = syscall(SYS_io_uring_enter, uring_fd, uring_queued,
+			    uring_queued, IORING_ENTER_GETEVENTS, NULL, 0);
+	if (submitted < 0)
+		FATAL("Failed to submit io_uring operations: %m\n");
+	if ((unsigned int)submitted != uring_queued) {
+		FATAL("io_uring submitted %ld of %u operations\n",
+		      submitted, uring_queued);
+	}
+
+	head = *uring_cq_head;
+
+	for (i = 0; i < uring_queued; ++i) {
+
+		cqe = &uring_cqes[(head + i) & *uring_cq_mask];
+		op = &uring_ops[cqe->user_data];
+
+		if (cqe->res < 0) {
+			FATAL("Failed to %s: %s/%s%s: %s\n",
+			      op->verb, httpd_conf_dir, op->dbdir,
+			      op->path, strerror(-cqe->res));
+		}
+	}
+
+	__atomic_store_n(uring_cq_head, head + uring_queued, __ATOMIC_RELEASE);
+
+	uring_queued = 0;
+}
+
+/*
+ * Reserve the next submission queue entry (flushing the current batch if the
+ * ring is full) and record the operation's bookkeeping.  name and path must
+ * remain valid until the batch is flushed.
+ */
+static struct io_uring_sqe *uring_queue(const char *const verb,
+					const char *const dbdir,
+					const char *const name,
+					const char *const path)
+{
+	struct io_uring_sqe *sqe;
+	struct uring_op *op;
+
+	if (uring_queued == URING_QUEUE_DEPTH)
+		uring_flush();
+
+	op = uring_ops + uring_queued;
+	op->verb = verb;
+	op->dbdir = dbdir;
+	op->name = name;
+	op->path = path;
+
+	sqe = uring_sqes + uring_queued;
+	memset(sqe, 0, sizeof *sqe);
+	sqe->user_data = uring_queued;
+
+	++uring_queued;
+
+	return sqe;
+}
+
+/*
+ * Queue an unlinkat(dirfd, name, 0) operation.  name and path are NOT
+ * copied; they must remain valid until uring_flush().
+ */
+static void uring_unlinkat(const int dirfd,
+			   const char *const restrict dbdir_name,
+			   const char *const restrict name,
+			   const char *const restrict path)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_queue("delete file", dbdir_name, name, path);
+	sqe->opcode = IORING_OP_UNLINKAT;
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t)name;
+}
+
+/*
+ * Queue a statx(dirfd, name, AT_SYMLINK_NOFOLLOW) operation.  name, path,
+ * and stx are NOT copied; they must remain valid until uring_flush().
+ */
+static void uring_statx(const int dirfd, const char *const restrict name,
+			const char *const restrict path,
+			struct statx *const restrict stx)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_queue("read file info", old_dbdir_name, name, path);
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t)name;
+	sqe->len = STATX_BASIC_STATS;
+	sqe->off = (uintptr_t)stx;
+	sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+}
+
+/*
+ * Convert a statx result to the struct stat fields that the copy functions
+ * actually use.
+ */
+static void uring_statx_to_stat(const struct statx *const restrict stx,
+				struct stat *const restrict st)
+{
+	memset(st, 0, sizeof *st);
+	st->st_mode = stx->stx_mode;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_size = stx->stx_size;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+}
+
+
+/*******************************************************************************
+ *
+ *
+ * 	File copy worker pool (--jobs)
+ *
+ *
+ ******************************************************************************/
+
+/* Forward declaration: defined in the directory copy section below */
+static void copy_file(int, int, const char *, const char *,
+		      const struct stat *);
+
+/*
+ * A queued call to copy_file().  The job owns srcpfd, which the worker that
+ * executes it closes.  The job itself (and name and path) live in the
+ * directory level's arena, which outlives the job: the level ends with
+ * pool_drain().
+ */
+struct copy_job {
+	struct copy_job *next;
+	struct stat srcst;
+	int srcpfd;
+	int destdir;
+	const char *name;
+	const char *path;
+};
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_todo = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+
+static struct copy_job *pool_head, *pool_tail;
+
+/* Jobs queued or currently executing */
+static unsigned int pool_outstanding;
+
+static _Bool pool_shutdown;
+static pthread_t *pool_threads;
+
+static void pool_lock(void)
+{
+	int err;
+
+	err = pthread_mutex_lock(&pool_mutex);
+	if (err != 0)
+		FATAL("Failed to lock worker pool mutex: %s\n", strerror(err));
+}
+
+static void pool_unlock(void)
+{
+	int err;
+
+	err = pthread_mutex_unlock(&pool_mutex);
+	if (err != 0) {
+		FATAL("Failed to unlock worker pool mutex: %s\n",
+		      strerror(err));
+	}
+}
+
+static void *pool_worker(void *const arg __attribute__((unused)))
+{
+	struct copy_job *job;
+	int err;
+
+	for (;;) {
+
+		pool_lock();
+
+		while (pool_head == NULL && !pool_shutdown) {
+			err = pthread_cond_wait(&pool_todo, &pool_mutex);
+			if (err != 0) {
+				FATAL("Failed to wait for copy job: %s\n",
+				      strerror(err));
+			}
+		}
+
+		if (pool_head == NULL) {
+			pool_unlock();
+			return NULL;
+		}
+
+		job = pool_head;
+		pool_head = job->next;
+		if (pool_head == NULL)
+			pool_tail = NULL;
+
+		pool_unlock();
+
+		copy_file(job->srcpfd, job->destdir, job->name, job->path,
+			  &job->srcst);
+
+		if (close(job->srcpfd) < 0) {
+			FATAL("Failed to close file: %s/%s%s: %m\n",
+			      httpd_conf_dir, old_dbdir_name, job->path);
+		}
+
+		pool_lock();
+
+		if (--pool_outstanding == 0) {
+			err = pthread_cond_broadcast(&pool_done);
+			if (err != 0) {
+				FATAL("Failed to signal copy completion: %s\n",
+				      strerror(err));
+			}
+		}
+
+		pool_unlock();
+	}
+}
+
+/*
+ * Queue a copy_file() call for execution by a worker thread.  Ownership of
+ * srcpfd passes to the job.  The job and its copy of name are allocated from
+ * arena (into which path must already point); the directory level frees them
+ * wholesale after pool_drain().
+ */
+static void pool_submit(struct arena *const arena, const int srcpfd,
+			const int destdir,
+			const char *const restrict name,
+			const char *const restrict path,
+			const struct stat *const restrict srcst)
+{
+	struct copy_job *job;
+	int err;
+
+	job = arena_alloc(arena, sizeof *job);
+
+	job->next = NULL;
+	job->srcst = *srcst;
+	job->srcpfd = srcpfd;
+	job->destdir = destdir;
+	job->path = path;
+
+	job->name = arena_strdup(arena, name);
+
+	pool_lock();
+
+	if (pool_tail == NULL)
+		pool_head = job;
+	else
+		pool_tail->next = job;
+	pool_tail = job;
+
+	++pool_outstanding;
+
+	err = pthread_cond_signal(&pool_todo);
+	if (err != 0)
+		FATAL("Failed to signal copy job: %s\n", strerror(err));
+
+	pool_unlock();
+}
+
+/*
+ * Wait for all queued copy jobs to complete.  Called at the end of each
+ * directory level, so that copy_metadata() in copy_subdir() never runs
+ * before the directory's contents are in place.
+ */
+static void pool_drain(void)
+{
+	int err;
+
+	pool_lock();
+
+	while (pool_outstanding != 0) {
+		err = pthread_cond_wait(&pool_done, &pool_mutex);
+		if (err != 0) {
+			FATAL("Failed to wait for copy completion: %s\n",
+			      strerror(err));
+		}
+	}
+
+	pool_unlock();
+}
+
+static void pool_start(void)
+{
+	unsigned int i;
+	int err;
+
+	pool_threads = malloc(copy_jobs * sizeof *pool_threads);
+	if (pool_threads == NULL)
+		FATAL("Memory allocation failed: %m\n");
+
+	for (i = 0; i < copy_jobs; ++i) {
+		err = pthread_create(pool_threads + i, NULL, pool_worker,
+				     NULL);
+		if (err != 0) {
+			FATAL("Failed to create worker thread: %s\n",
+			      strerror(err));
+		}
+	}
+
+	DEBUG("Started %u copy worker thread(s)\n", copy_jobs);
+}
+
+static void pool_stop(void)
+{
+	unsigned int i;
+	int err;
+
+	pool_lock();
+	pool_shutdown = 1;
+	err = pthread_cond_broadcast(&pool_todo);
+	if (err != 0)
+		FATAL("Failed to signal worker shutdown: %s\n", strerror(err));
+	pool_unlock();
+
+	for (i = 0; i < copy_jobs; ++i) {
+		err = pthread_join(pool_threads[i], NULL);
+		if (err != 0) {
+			FATAL("Failed to join worker thread: %s\n",
+			      strerror(err));
+		}
+	}
+
+	free(pool_threads);
+	pool_threads = NULL;
+	pool_shutdown = 0;
+}
+
+
+/*******************************************************************************
+ *
+ *
+ * 	Copy contents of old mod_nss database directory to new directory
+ *
+ *
+ ******************************************************************************/
+
+/*
+ * Each rotation writes a manifest (.manifest, one record per regular file)
+ * into the new database directory.  The next rotation loads the old
+ * directory's manifest and compares each source file's stat info against its
+ * record; a file that still matches is proven unmodified since it was
+ * published, so it is hard linked into the new directory instead of being
+ * copied.  An incremental rotation therefore costs one stat and one linkat
+ * per unchanged file, scaling with the size of the diff rather than the size
+ * of the tree.  A modified, new, or missing file simply misses the manifest
+ * and takes the normal copy path, so a stale or absent manifest costs
+ * nothing but speed.
+ */
+
+/* A record loaded from the old database directory's manifest */
+struct manifest_entry {
+	const char	*path;
+	off_t		size;
+	struct timespec	mtime;
+	uid_t		uid;
+	gid_t		gid;
+	mode_t		mode;
+};
+
+static struct manifest_entry *manifest_entries;
+static unsigned int num_manifest_entries;
+
+/* Contents of the old manifest (manifest_entries points into this) */
+static char *manifest_text;
+
+/* The new database directory's manifest, while it is being written */
+static FILE *manifest_out;
+
+static int manifest_cmp(const void *const a, const void *const b)
+{
+	return strcmp(((const struct manifest_entry *)a)->path,
+		      ((const struct manifest_entry *)b)->path);
+}
+
+/*
+ * Append a record for the named regular file to the new directory's
+ * manifest.  May be called from copy worker threads; a single fprintf is
+ * atomic enough.
+ */
+static void manifest_record(const char *const restrict path,
+			    const struct stat *const restrict st)
+{
+	if (manifest_out == NULL)
+		return;
+
+	fprintf(manifest_out, "%lld %lld.%09ld %lu %lu %o %s\n",
+		(long long)st->st_size, (long long)st->st_mtim.tv_sec,
+		st->st_mtim.tv_nsec, (unsigned long)st->st_uid,
+		(unsigned long)st->st_gid, (unsigned int)st->st_mode, path);
+}
+
+/*
+ * Load and parse the old database directory's manifest (if any).  A
+ * manifest that cannot be parsed is discarded with a warning; it only
+ * disables the fast path.
+ */
+static void manifest_load(const int srcdir)
+{
+	struct manifest_entry *ent;
+	unsigned int fmode;
+	unsigned long uid, gid;
+	long long size, sec;
+	char *line, *next;
+	ssize_t bytes_read;
+	struct stat st;
+	int fd, off;
+
+	fd = openat(srcdir, manifest_file_name,
+		    O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return;
+		FATAL("Failed to open file: %s/%s/%s: %m\n",
+		      httpd_conf_dir, old_dbdir_name, manifest_file_name);
+	}
+
+	if (fstat(fd, &st) < 0) {
+		FATAL("Failed to read file info: %s/%s/%s: %m\n",
+		      httpd_conf_dir, old_dbdir_name, manifest_file_name);
+	}
+
+	if (!S_ISREG(st.st_mode) || st.st_size <= 0
+			|| st.st_size > SSIZE_MAX) {
+		WARN("Ignoring invalid manifest: %s/%s/%s\n",
+		     httpd_conf_dir, old_dbdir_name, manifest_file_name);
+		goto close_fd;
+	}
+
+	manifest_text = malloc(st.st_size + 1);
+	if (manifest_text == NULL)
+		FATAL("Memory allocation failed: %m\n");
+
+	bytes_read = read(fd, manifest_text, st.st_size);
+	if (bytes_read < 0) {
+		FATAL("Failed to read file: %s/%s/%s: %m\n",
+		      httpd_conf_dir, old_dbdir_name, manifest_file_name);
+	}
+	if (bytes_read != st.st_size) {
+		FATAL("Failed to read complete file: %s/%s/%s\n",
+		      httpd_conf_dir, old_dbdir_name, manifest_file_name);
+	}
+
+	manifest_text[st.st_size] = 0;
+
+	for (line = manifest_text; *line != 0; ++num_manifest_entries) {
+		next = strchr(line, '\n');
+		if (next == NULL)
+			break;
+		line = next + 1;
+	}
+
+	manifest_entries = malloc(num_manifest_entries * sizeof *ent);
+	if (manifest_entries == NULL)
+		FATAL("Memory allocation failed: %m\n");
+
+	ent = manifest_entries;
+
+	for (line = manifest_text; (next = strchr(line, '\n')) != NULL;
+							line = next + 1) {
+		*next = 0;
+
+		if (sscanf(line, "%lld %lld.%ld %lu %lu %o %n",
+			   &size, &sec, &ent->mtime.tv_nsec, &uid, &gid,
+			   &fmode, &off) != 6 || line[off] == 0) {
+			WARN("Ignoring malformed manifest: %s/%s/%s\n",
+			     httpd_conf_dir, old_dbdir_name,
+			     manifest_file_name);
+			num_manifest_entries = 0;
+			goto close_fd;
+		}
+
+		ent->path = line + off;
+		ent->size = size;
+		ent->mtime.tv_sec = sec;
+		ent->uid = uid;
+		ent->gid = gid;
+		ent->mode = fmode;
+
+		++ent;
+	}
+
+	qsort(manifest_entries, num_manifest_entries,
+	      sizeof *manifest_entries, manifest_cmp);
+
+	DEBUG("Loaded manifest: %s/%s/%s (%u entries)\n",
+	      httpd_conf_dir, old_dbdir_name, manifest_file_name,
+	      num_manifest_entries);
+
+close_fd:
+	if (close(fd) < 0) {
+		FATAL("Failed to close file: %s/%s/%s: %m\n",
+		      httpd_conf_dir, old_dbdir_name, manifest_file_name);
+	}
+}
+
+/* Begin the new database directory's manifest */
+static void manifest_create(const int destdir)
+{
+	int fd;
+
+	fd = openat(destdir, manifest_file_name,
+		    O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+		    0600);
+	if (fd < 0) {
+		FATAL("Failed to create file: %s/%s/%s: %m\n",
+		      httpd_conf_dir, new_dbdir_name, manifest_file_name);
+	}
+
+	manifest_out = fdopen(fd, "w");
+	if (manifest_out == NULL) {
+		FATAL("Failed to open stream: %s/%s/%s: %m\n",
+		      httpd_conf_dir, new_dbdir_name, manifest_file_name);
+	}
+}
+
+/* Finish the new manifest and release the old one */
+static void manifest_finish(void)
+{
+	if (fclose(manifest_out) != 0) {
+		FATAL("Failed to write file: %s/%s/%s: %m\n",
+		      httpd_conf_dir, new_dbdir_name, manifest_file_name);
+	}
+
+	manifest_out = NULL;
+
+	free(manifest_entries);
+	manifest_entries = NULL;
+	num_manifest_entries = 0;
+
+	free(manifest_text);
+	manifest_text = NULL;
+}
+
+/*
+ * See copy_dir_contents().
+ *
+ * If the source file is a regular file whose stat info matches its record in
+ * the old manifest, hard link it into the new directory and return 1.
+ * Returns 0 (and does nothing) if the file must take the normal copy path.
+ */
+static _Bool manifest_link(const int srcdir, const int destdir,
+			   const char *const restrict name,
+			   const char *const restrict path,
+			   const struct stat *const restrict st)
+{
+	const struct manifest_entry *ent;
+	struct manifest_entry key;
+
+	if (num_manifest_entries == 0 || !S_ISREG(st->st_mode))
+		return 0;
+
+	key.path = path;
+
+	ent = bsearch(&key, manifest_entries, num_manifest_entries,
+		      sizeof *manifest_entries, manifest_cmp);
+
+	if (ent == NULL || ent->size != st->st_size
+			|| ent->mtime.tv_sec != st->st_mtim.tv_sec
+			|| ent->mtime.tv_nsec != st->st_mtim.tv_nsec
+			|| ent->uid != st->st_uid || ent->gid != st->st_gid
+			|| ent->mode != st->st_mode) {
+		return 0;
+	}
+
+	if (linkat(srcdir, name, destdir, name, 0) < 0) {
+
+		/*
+		 * The NSS database files already exist in the destination;
+		 * some filesystems refuse new hard links.
+		 */
+		if (errno == EEXIST || errno == EXDEV || errno == EPERM
+				|| errno == EMLINK || errno == EOPNOTSUPP) {
+			return 0;
+		}
+
+		FATAL("Failed to create hard link: %s/%s%s: %m\n",
+		      httpd_conf_dir, new_dbdir_name, path);
+	}
+
+	DEBUG("  hard linked (manifest match): %s/%s%s\n",
+	      httpd_conf_dir, new_dbdir_name, path);
+
+	TIMING_COUNT(timing_files_linked, 1);
+
+	manifest_record(path, st);
+
+	return 1;
+}
+
+/*
+ * See copy_file().
+ *
+ * Attempt to hard link the regular file refered to by srcpfd into the
+ * directory refered to by destdir (--link mode).  Because the link shares
+ * the source file's inode, no contents, ownership, permissions, or
+ * timestamps need to be copied.
+ *
+ * Returns 1 on success.  Returns 0 if the file must be deep copied instead
+ * -- the destination already exists (one of the NSS database files copied
+ * earlier), the link would cross filesystems, or the filesystem refuses the
+ * link.
+ */
+static _Bool link_file(const int srcpfd, const int destdir,
+		       const char *const restrict name,
+		       const char *const restrict path)
+{
+	char sproc[PROC_FD_PATH_SIZE];
+	_Bool linked;
+
+	assert(path[0] == '/' && path[1] != 0);
+
+	snprintf(sproc, sizeof sproc, "/proc/self/fd/%d", srcpfd);
+
+	if (linkat(AT_FDCWD, sproc, destdir, name, AT_SYMLINK_FOLLOW) == 0) {
+		DEBUG("  hard linked: %s/%s%s\n",
+		      httpd_conf_dir, new_dbdir_name, path);
+		linked = 1;
+	}
+	else if (errno == EEXIST || errno == EXDEV || errno == EPERM
+			|| errno == EMLINK || errno == EOPNOTSUPP) {
+		linked = 0;
+	}
+	else {
+		FATAL("Failed to create hard link: %s/%s%s: %m\n",
+		      httpd_conf_dir, new_dbdir_name, path);
+	}
+
+	return linked;
+}
+
+/*
+ * See copy_nssdb_dir().
+ *
+ * If the named file does not exist in the directory refered to by destdir,
+ * it is copied from the directory refered to by srcdir.  The copy is staged
+ * in an unnamed O_TMPFILE file, written and metadata-complete, and then
+ * published into the directory with a single linkat() -- the name never
+ * refers to a partially copied file.  If the filesystem does not support
+ * O_TMPFILE, the file is created visibly (as before).
+ *
+ * If the file already exists, only its metadata (ownership and permissions) are
+ * copied.
+ *
+ * path:  The path of the source and destination files, relative to the old and
+ *	  new mod_nss database directories respectively.  It MUST begin with a /
+ * 	  (and it cannot be an empty string).
+ *
+ * name:  The name of the source and destination files.  (path always ends with
+ * 	  name.)
+ */
+
+/* Benchmark mode (--bench) per-file latency hooks; see below */
+static void bench_file_begin(struct timespec *start);
+static void bench_file_finish(const struct timespec *start);
+
+static void copy_file(const int srcpfd, const int destdir,
+		      const char *const restrict name,
+		      const char *const restrict path,
+		      const struct stat *const restrict srcst)
+{
+	char dproc[PROC_FD_PATH_SIZE];
+	struct timespec bench_start;
+	_Bool copy_timestamps;
+	struct stat dstst;
+	_Bool tmpfile;
+	int src, dest;
+
+	assert(path[0] == '/' && path[1] != 0);
+
+	bench_file_begin(&bench_start);
+
+	if (hardlink_files && link_file(srcpfd, destdir, name, path)) {
+		manifest_record(path, srcst);
+		bench_file_finish(&bench_start);
+		return;
+	}
+
+	src = reopen_fd(srcpfd, O_RDONLY);
+
+	/*
+	 * If the file already exists, assume that it's one of the mod_nss
+	 * database files that was copied earlier.
+	 */
+	if (faccessat(destdir, name, F_OK, 0) == 0) {
+
+		dest = openat(destdir, name, O_WRONLY | O_NOFOLLOW);
+		if (dest < 0) {
+			FATAL("Failed to open file: %s/%s%s: %m\n",
+			      httpd_conf_dir, new_dbdir_name, path);
+		}
+
+		copy_timestamps = 0;
+		tmpfile = 0;
+	}
+	else {
+		if (errno != ENOENT) {
+			FATAL("Failed to check for file: %s/%s%s: %m\n",
+			      httpd_conf_dir, new_dbdir_name, path);
+		}
+
+		dest = openat(destdir, ".", O_TMPFILE | O_RDWR, 0600);
+		if (dest < 0) {
+
+			if (errno != EOPNOTSUPP && errno != EISDIR
+					&& errno != ENOENT) {
+				FATAL("Failed to create file: %s/%s%s: %m\n",
+				      httpd_conf_dir, new_dbdir_name, path);
+			}
+
+			/* No O_TMPFILE support; create the file visibly */
+			dest = openat(destdir, name,
+				      O_RDWR | O_CREAT | O_EXCL, 0600);
+			if (dest < 0) {
+				FATAL("Failed to create file: %s/%s%s: %m\n",
+				      httpd_conf_dir, new_dbdir_name, path);
+			}
+
+			tmpfile = 0;
+		}
+		else {
+			tmpfile = 1;
+		}
+
+		/* Skip leading / in path for copy_file_contents() */
+		copy_file_contents(src, dest, path + 1, srcst);
+		copy_timestamps = 1;
+		TIMING_COUNT(timing_files_copied, 1);
+	}
+
+	copy_metadata(dest, path, srcst, copy_timestamps);
+
+	/* Publish the staged file under its name in a single step */
+	if (tmpfile) {
+
+		snprintf(dproc, sizeof dproc, "/proc/self/fd/%d", dest);
+
+		if (linkat(AT_FDCWD, dproc, destdir, name,
+			   AT_SYMLINK_FOLLOW) < 0) {
+			FATAL("Failed to publish file: %s/%s%s: %m\n",
+			      httpd_conf_dir, new_dbdir_name, path);
+		}
+	}
+
+	/*
+	 * When the timestamps were copied, srcst describes the new file; the
+	 * NSS database files (already modified in place) must be re-stated.
+	 */
+	if (copy_timestamps) {
+		manifest_record(path, srcst);
+	}
+	else {
+		if (fstat(dest, &dstst) < 0) {
+			FATAL("Failed to read file info: %s/%s%s: %m\n",
+			      httpd_conf_dir, new_dbdir_name, path);
+		}
+		manifest_record(path, &dstst);
+	}
+
+	if (close(src) < 0) {
+		FATAL("Failed to close file: %s/%s%s: %m\n",
+		      httpd_conf_dir, old_dbdir_name, path);
+	}
+
+	if (close(dest) < 0) {
+		FATAL("Failed to close file: %s/%s%s: %m\n",
+		      httpd_conf_dir, new_dbdir_name, path);
+	}
+
+	bench_file_finish(&bench_start);
+}
+
+
+
+/*
+ * See copy_nssdb_dir().
+ *
+ * Create a symbolic link in the directory refered to by destdir.  The link
+ * target is copied from the symbolic link refered to by src.
+ *
+ * See copy_file() for the path and name parameters.
+ */
+static void copy_link(const int src, const int destdir,
+		      const char *const restrict name,
+		      const char *const restrict path,
+		      const struct stat *const restrict srcst)
+{
+	char *target;
+	int dest;
+
+	assert(path[0] == '/' && path[1] != 0);
+
+	if (srcst->st_size <= 0 || srcst->st_size > SSIZE_MAX - 1) {
+		FATAL("Symbolic link target size invalid: %s/%s%s\n",
+		      httpd_conf_dir, old_dbdir_name, path);
+	}
+
+	target = malloc(srcst->st_size + 1);
+	if (target == NULL)
+		FATAL("Memory allocation failed: %m\n");
+
+	memset(target, 0, srcst->st_size + 1);
+
+	if (readlinkat(src, "", target, srcst->st_size) < 0) {
+		FATAL("Failed to read symbolic link target: %s/%s%s: %m\n",
+		      httpd_conf_dir, old_dbdir_name, path);
+	}
+
+	dest = create_symlink(destdir, target, name, new_dbdir_name, path);
+
+	copy_metadata(dest, path, srcst, /* copy_timestamps = */ 1);
+
+	if (close(dest) < 0) {
+		FATAL("Failed to close symbolic link: %s/%s%s: %m\n",
+		      httpd_conf_dir, new_dbdir_name, path);
+	}
+
+	free(target);
+}
+
+/* Forward declaration for recursive call */
+static void copy_dir_contents(int, int, const char *);
+
+/*
+ * See copy_nssdb_dir().
+ *
+ * Copy the named subdirectory from srcdir to destdir.
+ *
+ * See copy_file() for the path and name parameters.
+ */
+static void copy_subdir(const int srcpfd, const int destdir,
+			const char *const restrict name,
+			const char *const restrict path,
+			const struct stat *const restrict srcst)
+{
+	int src, dest;
+
+	assert(path[0] == '/' && path[1] != 0);
+
+	src = reopen_fd(srcpfd, O_RDONLY | O_DIRECTORY);
+
+	if (mkdirat(destdir, name, 0700) < 0) {
+		FATAL("Failed to create directory: %s/%s%s: %m\n",
+		      httpd_conf_dir, new_dbdir_name, path);
+	}
+
+	dest = openat(destdir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (dest < 0) {
+		FATAL("Failed to open directory: %s/%s%s: %m\n",
+		      httpd_conf_dir, new_dbdir_name, path);
+	}
+
+	copy_dir_contents(src, dest, path);
+	copy_metadata(dest, path, srcst, /* copy_timestamps = */ 1);
+
+	if (close(src) < 0) {
+		FATAL("Failed to close directory: %s/%s%s: %m\n",
+		      httpd_conf_dir, old_dbdir_name, path);
+	}
+
+	if (close(dest) < 0) {
+		FATAL("Failed to close directory: %s/%s%s: %m\n",
+		      httpd_conf_dir, new_dbdir_name, path);
+	}
+}
+
+/*
+ * See copy_nssdb_dir().
+ *
+ * Copy the contents of the directory refered to by srcdir to the directory
+ * refered to by by destdir.
+ *
+ * subdir is the path to srcdir and destdir, relative to old_nssdb_dir and
+ * new_nssdb_dir respectively.
+ *
+ * subdir:  The path of the source and destination directories, relative to the
+ * 	    old and new mod_nss database directories respectively.  It MUST
+ * 	    begin with a / or be an empty string.
+ */
+/*
+ * See copy_dir_contents().
+ *
+ * Process a single directory entry whose file type is already known.
+ * Takes ownership of the O_PATH file descriptor refered to by src, which is
+ * closed here (or by the worker pool job that inherits it).  path must point
+ * into arena (the directory level's arena); name need only survive the call,
+ * because pool jobs copy it into the arena themselves.
+ */
+static void copy_dir_entry(struct arena *const arena, const int src,
+			   const int destdir,
+			   const char *const restrict name,
+			   const char *const restrict path,
+			   const struct stat *const restrict st)
+{
+	switch (st->st_mode & S_IFMT) {
+
+		case S_IFREG:
+			if (pool_threads != NULL) {
+				/* The job takes ownership of src */
+				pool_submit(arena, src, destdir, name, path,
+					    st);
+				return;
+			}
+			copy_file(src, destdir, name, path, st);
+			break;
+
+		case S_IFLNK:
+			copy_link(src, destdir, name, path, st);
+			break;
+
+		case S_IFDIR:
+			copy_subdir(src, destdir, name, path, st);
+			break;
+
+		default:
+			FATAL("Unsupported file type: %s/%s%s\n",
+			      httpd_conf_dir, old_dbdir_name, path);
+	}
+
+	if (close(src) < 0) {
+		FATAL("Failed to close file: %s/%s%s: %m\n",
+		      httpd_conf_dir, old_dbdir_name, path);
+	}
+}
+
+/* A directory entry collected for batched statx processing (--uring) */
+struct uring_dir_ent {
+	struct uring_dir_ent *next;
+	struct statx stx;
+	const char *name;
+	const char *path;
+};
+
+static void copy_dir_contents(const int srcdir, const int destdir,
+			      const char *const subdir)
+{
+	struct uring_dir_ent *ents, **enttail, *ent;
+	struct arena arena = ARENA_INIT;
+	struct dir_reader reader;
+	struct dirent64 *d;
+	struct stat st;
+	int dirfd, src;
+	char *path;
+
+	assert(*subdir == '/' || *subdir == 0);
+
+	ents = NULL;
+	enttail = &ents;
+
+	/* srcdir is a real descriptor; just get an independent stream */
+	dirfd = dup_fd(srcdir);
+
+	dir_reader_init(&reader, &arena, dirfd, old_dbdir_name, subdir);
+
+	while ((d = dir_reader_next(&reader)) != NULL) {
+
+		TIMING_COUNT(timing_dirents_scanned, 1);
+
+		if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+			continue;
+
+		/* The new directory gets its own manifest */
+		if (*subdir == 0
+				&& strcmp(d->d_name, manifest_file_name) == 0)
+			continue;
+
+		path = arena_printf(&arena, "%s/%s", subdir, d->d_name);
+
+		if (use_uring) {
+
+			/*
+			 * Collect the entry and queue its statx; the batch
+			 * is processed after the directory has been read.
+			 */
+
+			ent = arena_alloc(&arena, sizeof *ent);
+
+			ent->next = NULL;
+			ent->path = path;
+			ent->name = arena_strdup(&arena, d->d_name);
+
+			*enttail = ent;
+			enttail = &ent->next;
+
+			uring_statx(srcdir, ent->name, ent->path, &ent->stx);
+			continue;
+		}
+
+		if (fstatat(srcdir, d->d_name, &st, AT_SYMLINK_NOFOLLOW)
+				< 0) {
+			FATAL("Failed to read file info: %s/%s%s: %m\n",
+			      httpd_conf_dir, old_dbdir_name, path);
+		}
+
+		if (manifest_link(srcdir, destdir, d->d_name, path, &st))
+			continue;
+
+		src = openat(srcdir, d->d_name,
+			     O_RDONLY  | O_NOFOLLOW | O_PATH);
+		if (src < 0) {
+			FATAL("Failed to open file: %s/%s%s: %m\n",
+			      httpd_conf_dir, old_dbdir_name, path);
+		}
+
+		copy_dir_entry(&arena, src, destdir, d->d_name, path, &st);
+	}
+
+	if (close(dirfd) < 0) {
+		FATAL("Failed to close directory: %s/%s%s: %m\n",
+		      httpd_conf_dir, old_dbdir_name, subdir);
+	}
+
+	if (use_uring) {
+
+		uring_flush();
+
+		while ((ent = ents) != NULL) {
+
+			ents = ent->next;
+
+			uring_statx_to_stat(&ent->stx, &st);
+
+			if (manifest_link(srcdir, destdir, ent->name,
+					  ent->path, &st))
+				continue;
+
+			src = openat(srcdir, ent->name,
+				     O_RDONLY | O_NOFOLLOW | O_PATH);
+			if (src < 0) {
+				FATAL("Failed to open file: %s/%s%s: %m\n",
+				      httpd_conf_dir, old_dbdir_name,
+				      ent->path);
+			}
+
+			copy_dir_entry(&arena, src, destdir, ent->name,
+				       ent->path, &st);
+		}
+	}
+
+	/*
+	 * Per-directory barrier: the caller (copy_subdir) will copy this
+	 * directory's metadata next, so its queued file copies must complete
+	 * first.
+	 */
+	if (pool_threads != NULL)
+		pool_drain();
+
+	arena_free(&arena);
+}
+
+/*
+ * Recursively copies the contents of the directory refered to by srcdir
+ * (old_dbdir_name) to the directory refered to by destdir (new_dbdir_name).
+ * Ownership, permissions, and SELinux contexts are also copied.  Timestamps
+ * (atime and mtime) are copied for files that don't already exist in the
+ * destination directory.
+ *
+ * Files that already exist in the destination directory (NSS database files)
+ * are not overwritten, nor are their timestamps modified.  Ownership,
+ * permissions, and SELinux contexts ARE copied from the corresponding file in
+ * the source directory.
+ *
+ * Only regular files, symbolic links, and subdirectories may exist in the
+ * source directory; the presence of any other type of filesystem object is a
+ * fatal error.  The presence of any pre-existing filesystem object other than
+ * a regular file in the destination directory is also a fatal error (if its
+ * relative path matches that of an object in the source directory).
+ *
+ * Call graph:
+ *
+ *   copy_nssdb_dir
+ *     │
+ *     └─> copy_dir_contents <──────────┐
+ *          │                           │
+ *          ├─> copy_subdir ────────────┘
+ *          │
+ *          ├─> copy_file
+ *          │
+ *          └─> copy_link
+ */
+static void copy_nssdb_dir(const int srcdir, const int destdir)
+{
+	struct stat srcst;
+
+	manifest_load(srcdir);
+	manifest_create(destdir);
+
+	if (copy_jobs > 0)
+		pool_start();
+
+	copy_dir_contents(srcdir, destdir, "");
+
+	if (copy_jobs > 0)
+		pool_stop();
+
+	manifest_finish();
+
+	if (fstat(srcdir, &srcst) < 0) {
+		FATAL("Failed to read directory info: %s/%s: %m\n",
+		      httpd_conf_dir, old_dbdir_name);
+	}
+
+	copy_metadata(destdir, "", &srcst, /* copy_timestamps = */ 0);
+}
+
+
+/*******************************************************************************
+ *
+ *
+ * 	Delete the old mod_nss database directory
+ *
+ *
+ ******************************************************************************/
+
+/*
+ * See trash_old_nssdb_dir().
+ *
+ * Deletes all files, symbolic links, and subdirectories in the directory
+ * refered to by dirfd.
+ *
+ * dbdir_name:  The name of the database (or trash) directory being deleted,
+ * 		used in log messages.
+ *
+ * subdir:  The path of the directory refered to by dirfd, relative to the
+ * 	    directory being deleted.  It MUST begin with a / or be an empty
+ * 	    string.
+ */
+
+/*
+ * The deletion engine is iterative: directories being emptied form an
+ * explicit stack of levels (a linked list, each level allocated in its own
+ * arena), so an arbitrarily deep tree cannot exhaust the C stack.  Reliable
+ * d_type values are trusted, so non-directories are unlinked straight from
+ * the getdents batch, in batch order, with no per-entry stat; DT_UNKNOWN
+ * (filesystems that don't fill in d_type) falls back to one fstatat.
+ */
+struct delete_level {
+	struct delete_level	*parent;
+	struct arena		arena;
+	struct dir_reader	reader;
+	const char		*name;	/* in the parent level's arena */
+	const char		*path;	/* in the parent level's arena */
+	int			dirfd;
+	int			streamfd;
+};
+
+/*
+ * Begin emptying a directory: open it for reading and put it on top of the
+ * stack.  name and path must outlive the level (they live in the parent
+ * level's arena); the level takes ownership of dirfd unless it is the root
+ * level (parent == NULL), whose descriptor belongs to the caller.
+ */
+static struct delete_level *delete_level_push(struct delete_level *const
+								parent,
+					      const int dirfd,
+					      const char *const name,
+					      const char *const path,
+					      const char *const dbdir_name)
+{
+	struct arena arena = ARENA_INIT;
+	struct delete_level *level;
+
+	level = arena_alloc(&arena, sizeof *level);
+
+	level->parent = parent;
+	level->arena = arena;
+	level->name = name;
+	level->path = path;
+	level->dirfd = dirfd;
+
+	/* dirfd is a real descriptor; just get an independent stream */
+	level->streamfd = dup_fd(dirfd);
+
+	dir_reader_init(&level->reader, &level->arena, level->streamfd,
+			dbdir_name, path);
+
+	return level;
+}
+
+static void delete_dir_contents(const int dirfd,
+				const char *const restrict dbdir_name,
+				const char *const restrict subdir)
+{
+	struct delete_level *top, *level;
+	struct dirent64 *d;
+	struct arena arena;
+	struct stat st;
+	char *path;
+	int fd;
+
+	assert(*subdir == '/' || *subdir == 0);
+
+	top = delete_level_push(NULL, dirfd, NULL, subdir, dbdir_name);
+
+	while (top != NULL) {
+
+		d = dir_reader_next(&top->reader);
+
+		if (d == NULL) {
+
+			/* This directory is now empty; pop and remove it */
+
+			level = top;
+			top = level->parent;
+
+			if (close(level->streamfd) < 0) {
+				FATAL("Failed to close directory: "
+				      "%s/%s%s: %m\n",
+				      httpd_conf_dir, dbdir_name,
+				      level->path);
+			}
+
+			/*
+			 * All batched unlinks must complete before the (now
+			 * empty) directory is removed.
+			 */
+			if (use_uring)
+				uring_flush();
+
+			if (top != NULL) {
+
+				if (close(level->dirfd) < 0) {
+					FATAL("Failed to close directory: "
+					      "%s/%s%s: %m\n",
+					      httpd_conf_dir, dbdir_name,
+					      level->path);
+				}
+
+				if (unlinkat(top->dirfd, level->name,
+					     AT_REMOVEDIR) < 0) {
+					FATAL("Failed to delete directory: "
+					      "%s/%s%s: %m\n",
+					      httpd_conf_dir, dbdir_name,
+					      level->path);
+				}
+			}
+
+			/*
+			 * The level itself lives in its arena; copy the
+			 * arena header out before freeing it.
+			 */
+			arena = level->arena;
+			arena_free(&arena);
+
+			continue;
+		}
+
+		if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+			continue;
+
+		path = arena_printf(&top->arena, "%s/%s", top->path,
+				    d->d_name);
+
+		/*
+		 * Entries whose type is reliably known not to be a directory
+		 * are unlinked directly, in getdents batch order.  With
+		 * --uring the unlink is also batched; the queued operation
+		 * references the name until the batch is flushed, so it is
+		 * copied into the arena.
+		 */
+		if (d->d_type == DT_UNKNOWN) {
+
+			if (fstatat(top->dirfd, d->d_name, &st,
+				    AT_SYMLINK_NOFOLLOW) < 0) {
+				FATAL("Failed to read file info: "
+				      "%s/%s%s: %m\n",
+				      httpd_conf_dir, dbdir_name, path);
+			}
+		}
+		else {
+			st.st_mode = d->d_type == DT_DIR ? S_IFDIR : S_IFREG;
+		}
+
+		if (!S_ISDIR(st.st_mode)) {
+
+			if (use_uring) {
+				uring_unlinkat(top->dirfd, dbdir_name,
+					       arena_strdup(&top->arena,
+							    d->d_name),
+					       path);
+				continue;
+			}
+
+			if (unlinkat(top->dirfd, d->d_name, 0) < 0) {
+				FATAL("Failed to delete file: %s/%s%s: %m\n",
+				      httpd_conf_dir, dbdir_name, path);
+			}
+
+			continue;
+		}
+
+		/* A directory; descend into it */
+
+		fd = openat(top->dirfd, d->d_name,
+			    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (fd < 0) {
+			FATAL("Failed to open directory: %s/%s%s: %m\n",
+			      httpd_conf_dir, dbdir_name, path);
+		}
+
+		top = delete_level_push(top, fd,
+					arena_strdup(&top->arena, d->d_name),
+					path, dbdir_name);
+	}
+}
+
+/*
+ * Moves the old NSS database directory out of the critical path with a
+ * single rename, giving it a .trash-YYYYMMDDHHMMSS holding name (reusing the
+ * old directory's own timestamp, which is unique).  The directory is
+ * actually purged later -- by purge_trash_dirs() in a forked child, or by a
+ * subsequent invocation if that child does not survive.
+ */
+static void trash_dbdir(const int httpd_conf_dirfd,
+			const char *const dbdir_name)
+{
+	char trash_name[TRASH_DIR_PFX_LEN + NSSDB_DIR_TS_SIZE];
+
+	memcpy(trash_name, TRASH_DIR_PREFIX, TRASH_DIR_PFX_LEN);
+	memcpy(trash_name + TRASH_DIR_PFX_LEN,
+	       dbdir_name + NSSDB_DIR_PFX_LEN, NSSDB_DIR_TS_SIZE);
+
+	if (renameat(httpd_conf_dirfd, dbdir_name,
+		     httpd_conf_dirfd, trash_name) < 0) {
+		FATAL("Failed to rename directory: %s/%s to %s/%s: %m\n",
+		      httpd_conf_dir, dbdir_name,
+		      httpd_conf_dir, trash_name);
+	}
+
+	DEBUG("Renamed old directory: %s/%s to %s/%s\n",
+	      httpd_conf_dir, dbdir_name, httpd_conf_dir, trash_name);
+}
+
+static void trash_old_nssdb_dir(const int httpd_conf_dirfd)
+{
+	trash_dbdir(httpd_conf_dirfd, old_dbdir_name);
+}
+
+/*
+ * Recursively deletes every .trash-* directory in /etc/httpd -- the one just
+ * renamed by trash_old_nssdb_dir() plus any left behind by previous runs.
+ */
+static void purge_trash_dirs(const int httpd_conf_dirfd)
+{
+	struct dirent *d;
+	int fd, dirfd;
+	DIR *dir;
+
+	/* Get an independent file descriptor for the directory stream */
+	fd = dup_fd(httpd_conf_dirfd);
+
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		FATAL("Failed to open directory stream: %s: %m\n",
+		      httpd_conf_dir);
+	}
+
+	while ((errno = 0, d = readdir(dir)) != NULL) {
+
+		if (strncmp(d->d_name, TRASH_DIR_PREFIX, TRASH_DIR_PFX_LEN)
+				!= 0) {
+			continue;
+		}
+
+		dirfd = openat(httpd_conf_dirfd, d->d_name,
+			       O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (dirfd < 0) {
+			FATAL("Failed to open directory: %s/%s: %m\n",
+			      httpd_conf_dir, d->d_name);
+		}
+
+		delete_dir_contents(dirfd, d->d_name, "");
+
+		if (unlinkat(httpd_conf_dirfd, d->d_name, AT_REMOVEDIR) < 0) {
+			FATAL("Failed to remove directory: %s/%s: %m\n",
+			      httpd_conf_dir, d->d_name);
+		}
+
+		if (close(dirfd) < 0) {
+			FATAL("Failed to close directory: %s/%s: %m\n",
+			      httpd_conf_dir, d->d_name);
+		}
+
+		INFO("Purged old directory: %s/%s\n",
+		     httpd_conf_dir, d->d_name);
+	}
+	if (errno != 0)
+		FATAL("Failed to read directory: %s: %m\n", httpd_conf_dir);
+
+	if (closedir(dir) < 0) {
+		FATAL("Failed to close directory stream: %s: %m\n",
+		      httpd_conf_dir);
+	}
+}
+
+/*
+ * Purges the trashed database directories in a forked child process, so that
+ * the httpd reload that follows this program does not wait behind the
+ * recursive deletion.
+ */
+static void background_purge(const int httpd_conf_dirfd)
+{
+	pid_t pid;
+
+	/* Don't let the child inherit (and re-emit) buffered log records */
+	log_flush();
+
+	pid = fork();
+	if (pid < 0)
+		FATAL("Failed to fork trash purge process: %m\n");
+
+	if (pid == 0) {
+
+		/* The parent's ring cannot be shared; get a private one */
+		if (use_uring) {
+			uring_teardown();
+			uring_setup();
+		}
+
+		purge_trash_dirs(httpd_conf_dirfd);
+		log_flush();	/* _exit() skips the atexit() handler */
+		_exit(EXIT_SUCCESS);
+	}
+
+	DEBUG("Purging trashed directories in background process %ld\n",
+	      (long)pid);
+}
+
+
+/*******************************************************************************
+ *
+ *
+ * 	mod_nss database stuff
+ *
+ *
+ ******************************************************************************/
+
+/*
+ * The certificate updates only ever touch the internal softoken slot, so
+ * skip loading the external PKCS#11 modules listed in the module database
+ * (which can probe hardware tokens for seconds) and the root-certs module.
+ */
+#define NSS_INIT_FLAGS	(NSS_INIT_NOMODDB | NSS_INIT_NOROOTINIT)
+
+static PK11SlotInfo *init_libnss(const int new_nssdb_dirfd)
+{
+	PK11SlotInfo *slot;
+
+	if (fchdir(new_nssdb_dirfd) < 0) {
+		FATAL("Failed to change directory: %s/%s: %m\n",
+		      httpd_conf_dir, new_dbdir_name);
+	}
+
+	if (NSS_Initialize(nssdb_sql ? "sql:." : ".", "", "", SECMOD_DB,
+			   NSS_INIT_FLAGS) != SECSuccess) {
+		NSS_FATAL("Failed to open NSS database: %s/%s\n",
+			  httpd_conf_dir, new_dbdir_name);
+	}
+
+	slot = PK11_GetInternalKeySlot();
+	if (slot == NULL) {
+		NSS_FATAL("Failed to open NSS database slot: %s/%s\n",
+			  httpd_conf_dir, new_dbdir_name);
+	}
+
+	if (!PK11_IsFriendly(slot)) {
+		FATAL("NSS database requires authentication: %s/%s\n",
+		      httpd_conf_dir, new_dbdir_name);
+	}
+
+	return slot;
+}
+
+static void shutdown_libnss(PK11SlotInfo *const slot)
+{
+	PK11_FreeSlot(slot);
+
+	if (NSS_Shutdown() != SECSuccess) {
+		NSS_FATAL("Failed to close NSS database: %s/%s\n",
+			  httpd_conf_dir, new_dbdir_name);
+	}
+
+	/* In daemon mode NSPR stays warm for the next rotation */
+	if (!daemon_mode) {
+
+		PL_ArenaFinish();
+
+		if (PR_Cleanup() != PR_SUCCESS)
+			NSS_FATAL("Failed to shut down NSPR library\n");
+	}
+}
+
+static CERTCertificate *new_certificate(void)
+{
+	CERTCertificate *cert;
+	char *cert_file;
+	struct stat st;
+	SECItem der;
+	void *buf;
+	int fd;
+
+	if (asprintf(&cert_file, "%s/%s.crt", acme_cert_dir, cert_hostname)
+			< 0) {
+		FATAL("Failed to format path: %s/%s.crt: %m\n",
+		      acme_cert_dir, cert_hostname);
+	}
+
+	fd = open(cert_file, O_RDONLY);
+	if (fd < 0)
+		FATAL("Failed to open file: %s: %m\n", cert_file);
+
+	if (fstat(fd, &st) < 0)
+		FATAL("Failed to read file info: %s: %m\n", cert_file);
+
+	if (st.st_size <= 0 || st.st_size > SSIZE_MAX)
+		FATAL("File size invalid: %s\n", cert_file);
+
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED)
+		FATAL("Failed to map file: %s: %m\n", cert_file);
+
+	if (close(fd) < 0)
+		FATAL("Failed to close file: %s: %m\n", cert_file);
+
+	/*
+	 * A DER certificate starts with an ASN.1 SEQUENCE tag (0x30), which
+	 * cannot begin a PEM file; decode it directly, skipping the base64
+	 * sniffing (and copying) in CERT_DecodeCertFromPackage().
+	 */
+	if (*(unsigned char *)buf == 0x30) {
+		der.type = siBuffer;
+		der.data = buf;
+		der.len = st.st_size;
+		cert = CERT_NewTempCertificate(CERT_GetDefaultCertDB(), &der,
+					       NULL, PR_FALSE, PR_TRUE);
+	}
+	else {
+		cert = CERT_DecodeCertFromPackage(buf, st.st_size);
+	}
+	if (cert == NULL)
+		NSS_FATAL("Failed to parse certificate: %s\n", cert_file);
+
+	if (munmap(buf, st.st_size) < 0)
+		FATAL("Failed to unmap file: %s: %m\n", cert_file);
+
+	free(cert_file);
+
+	return cert;
+}
+
+static const char *format_not_after(const CERTCertificate *const cert)
+{
+	static const char time_format[] = "%a %b %d %H:%M:%S %Y UTC";
+	static char buf[100];
+
+	PRExplodedTime etime;
+	PRTime prtime;
+
+	if (cert->validity.notAfter.type == siUTCTime) {
+
+		if (DER_UTCTimeToTime(&prtime, &cert->validity.notAfter)
+				!= SECSuccess) {
+			NSS_FATAL("Failed to decode ASN.1 time "
+				  "in certificate for %s\n",
+				  cert->nickname);
+		}
+	}
+	else if (cert->validity.notAfter.type == siGeneralizedTime) {
+
+		if (DER_GeneralizedTimeToTime(&prtime, &cert->validity.notAfter)
+				!= SECSuccess) {
+			NSS_FATAL("Failed to decode ASN.1 time "
+				  "in certificate for %s\n",
+				  cert->nickname);
+		}
+	}
+	else {
+		FATAL("Unknown ASN.1 time type in certificate for %s\n",
+		      cert->nickname);
+	}
+
+	PR_ExplodeTime(prtime, PR_GMTParameters, &etime);
+	PR_FormatTime(buf, sizeof buf, time_format, &etime);
+
+	return buf;
+}
+
+/*
+ * See check_installed_certs().
+ *
+ * Returns 1 if the certificate in the database nicknamed cert_hostname is
+ * byte-identical (DER comparison) to cert.
+ */
+static _Bool cert_already_installed(const CERTCertificate *const cert)
+{
+	CERTCertificate *installed;
+	_Bool same;
+
+	installed = PK11_FindCertFromNickname(cert_hostname, NULL);
+	if (installed == NULL)
+		return 0;
+
+	same = installed->derCert.len == cert->derCert.len
+			&& memcmp(installed->derCert.data, cert->derCert.data,
+				  cert->derCert.len) == 0;
+
+	CERT_DestroyCertificate(installed);
+
+	return same;
+}
+
+/*
+ * Fast path: opens the EXISTING database read-only and removes from the
+ * hostname list every hostname whose certificate file is already installed
+ * (which happens when a previous run succeeded but its ${HOSTNAME}.new
+ * symlink was left behind).  Returns 1 if nothing remains to be done, in
+ * which case no new database directory should be created.
+ */
+static _Bool check_installed_certs(const int old_nssdb_dirfd)
+{
+	unsigned int h, remaining;
+	CERTCertificate *cert;
+
+	if (fchdir(old_nssdb_dirfd) < 0) {
+		FATAL("Failed to change directory: %s/%s: %m\n",
+		      httpd_conf_dir, old_dbdir_name);
+	}
+
+	if (NSS_Initialize(nssdb_sql ? "sql:." : ".", "", "", SECMOD_DB,
+			   NSS_INIT_FLAGS | NSS_INIT_READONLY)
+			!= SECSuccess) {
+		NSS_FATAL("Failed to open NSS database: %s/%s\n",
+			  httpd_conf_dir, old_dbdir_name);
+	}
+
+	remaining = 0;
+
+	for (h = 0; h < num_cert_hostnames; ++h) {
+
+		cert_hostname = cert_hostnames[h];
+		cert = new_certificate();
+
+		if (cert_already_installed(cert)) {
+			INFO("Certificate for %s already installed; "
+			     "skipping\n",
+			     cert_hostname);
+		}
+		else {
+			cert_hostnames[remaining++] = cert_hostnames[h];
+		}
+
+		CERT_DestroyCertificate(cert);
+	}
+
+	num_cert_hostnames = remaining;
+
+	if (NSS_Shutdown() != SECSuccess) {
+		NSS_FATAL("Failed to close NSS database: %s/%s\n",
+			  httpd_conf_dir, old_dbdir_name);
+	}
+
+	return num_cert_hostnames == 0;
+}
+
+/*
+ * PK11_FindCertsFromNickname() resolves the nickname through the database's
+ * index instead of enumerating the whole database, so deleting the old
+ * certificates for one hostname doesn't scale with the (possibly thousands
+ * of) certificates that other hostnames have in a shared database.  A NULL
+ * result just means that no certificates matched.
+ */
+static void remove_old_certs(void)
+{
+	CERTCertListNode *node;
+	CERTCertList *list;
+	unsigned deleted;
+
+	INFO("Deleting existing certificates for %s from NSS database: %s/%s\n",
+	     cert_hostname, httpd_conf_dir, new_dbdir_name);
+
+	deleted = 0;
+
+	list = PK11_FindCertsFromNickname(cert_hostname, NULL);
+	if (list == NULL)
+		goto done;
+
+	for (	node = CERT_LIST_HEAD(list);
+				!CERT_LIST_END(node, list);
+						node = CERT_LIST_NEXT(node)) {
+
+		/*
+		 * Only matches reach this point, so the expiry formatting
+		 * (two DER time decodes) runs per match -- and, because
+		 * DEBUG() only evaluates its arguments when debug logging is
+		 * enabled, only when the message will actually be logged.
+		 */
+		DEBUG("  %s: expires %s ... DELETING\n",
+		      node->cert->nickname, format_not_after(node->cert));
+
+		if (SEC_DeletePermCertificate(node->cert) != SECSuccess) {
+			NSS_FATAL("Failed to delete certificate for %s "
+				  "expiring %s from NSS database: %s/%s\n",
+				  cert_hostname, format_not_after(node->cert),
+				  httpd_conf_dir, new_dbdir_name);
+		}
+
+		++deleted;
+	}
+
+	CERT_DestroyCertList(list);
+
+done:
+	INFO("Deleted %u existing certificate(s)\n", deleted);
+
+	metrics_certs_removed += deleted;
+}
+
+static void add_new_cert(PK11SlotInfo *const restrict slot,
+			 CERTCertificate *const restrict cert)
+{
+	if (PK11_ImportCert(slot, cert, 0, cert_hostname, 0) != SECSuccess) {
+		NSS_FATAL("Failed to add certificate for %s to NSS database: "
+			  "%s/%s\n",
+			  cert_hostname, httpd_conf_dir, new_dbdir_name);
+	}
+
+	NOTICE("Updated mod_nss certificate for %s\n", cert_hostname);
+	NOTICE("New certificate valid until %s\n", format_not_after(cert));
+}
+
+
+/*******************************************************************************
+ *
+ *
+ * 	main()
+ *
+ *
+ ******************************************************************************/
+
+static void set_effective_user(const uid_t uid, const gid_t gid)
+{
+	if (setegid(gid) != 0) {
+		FATAL("Failed to change effective GID to %" PRIdMAX ": %m\n",
+		      (intmax_t)gid);
+	}
+
+	if (seteuid(uid) != 0) {
+		FATAL("Failed to change effective UID to %" PRIdMAX ": %m\n",
+		      (intmax_t)uid);
+	}
+
+	if (geteuid() != uid) {
+		FATAL("Effective UID not really changed (still %" PRIdMAX ")\n",
+		      (intmax_t)geteuid());
+	}
+
+	if (getegid() != gid) {
+		FATAL("Effective GID not really changed (still %" PRIdMAX ")\n",
+		      (intmax_t)getegid());
+	}
+
+	DEBUG("Effective uid/gid changed to %" PRIdMAX "/%" PRIdMAX "\n",
+	      (intmax_t)uid, (intmax_t)gid);
+}
+
+/*
+ * Change the CALLING THREAD's effective user and group only.  glibc's
+ * seteuid()/setegid() broadcast the change to every thread in the process,
+ * which would strip the overlapped copy thread (which must keep running as
+ * root) of its privileges; the raw syscalls affect only this thread.
+ */
+static void set_thread_effective_user(const uid_t uid, const gid_t gid)
+{
+	if (syscall(SYS_setresgid, (long)-1, (long)gid, (long)-1) != 0) {
+		FATAL("Failed to change effective GID to %" PRIdMAX ": %m\n",
+		      (intmax_t)gid);
+	}
 
-		if (close(dest) < 0) {
-			FATAL("Failed to close file: %s/%s/%s: %m\n",
-			      httpd_conf_dir, new_dbdir_name, *name);
-		}
+	if (syscall(SYS_setresuid, (long)-1, (long)uid, (long)-1) != 0) {
+		FATAL("Failed to change effective UID to %" PRIdMAX ": %m\n",
+		      (intmax_t)uid);
 	}
+
+	DEBUG("Thread effective uid/gid changed to %" PRIdMAX "/%" PRIdMAX
+	      "\n", (intmax_t)uid, (intmax_t)gid);
 }
 
 /*
- * Open a "copy" of a file descriptor.
+ * See find_prestaged_dir().
+ *
+ * Returns 1 if the NSS database files in the pre-staged directory refered to
+ * by dirfd still match (size and mtime) the files in the current database
+ * directory refered to by old_nssdb_dirfd.
  */
-static int copy_fd(const int orig, const int flags)
+static _Bool prestaged_dir_fresh(const int old_nssdb_dirfd, const int dirfd)
 {
-	char *path;
-	int fd;
+	const char *const *name;
+	struct stat oldst, newst;
 
-	if (asprintf(&path, "/proc/self/fd/%d", orig) < 0)
-		FATAL("Failed to format path: /proc/self/fd/%d: %m\n", orig);
+	for (name = nssdb_file_names; *name != NULL; ++name) {
 
-	fd = open(path, flags);
-	if (fd < 0)
-		FATAL("Failed to open file: %s: %m\n", path);
+		if (fstatat(old_nssdb_dirfd, *name, &oldst, 0) < 0) {
+			FATAL("Failed to read file info: %s/%s/%s: %m\n",
+			      httpd_conf_dir, old_dbdir_name, *name);
+		}
 
-	free(path);
+		if (fstatat(dirfd, *name, &newst, 0) < 0) {
+			if (errno == ENOENT)
+				return 0;
+			FATAL("Failed to read file info: %s/%s: %m\n",
+			      httpd_conf_dir, *name);
+		}
 
-	return fd;
+		if (oldst.st_size != newst.st_size
+				|| oldst.st_mtim.tv_sec != newst.st_mtim.tv_sec
+				|| oldst.st_mtim.tv_nsec
+						!= newst.st_mtim.tv_nsec) {
+			return 0;
+		}
+	}
+
+	return 1;
 }
 
 /*
- * Create a new symbolic link and return a file descriptor that refers to it.
- *
- * path:	The path of the symbolic link to be created, relative to
- *		either old_nssdb_dir, new_nssdb_dir, or httpd_conf_dir.  If
- * 		dbdir_name is an empty string, path must NOT begin with a /;
- * 		otherwise it MUST begin with a slash.  In either case, it must
- * 		not be an empty string.
- *
- * name:	The name of the symbolic link to be created.  (path always ends
- * 		with name.)
+ * Looks for a directory pre-staged (by --prestage) from the CURRENT database
+ * directory.  Pre-staged directories built from an older generation, or
+ * whose database files no longer match the current ones, are renamed for
+ * background deletion.
  *
- * dbdir_name:  The name of the directory (under httpd_conf_dir) relative to
- * 		which path is interpreted -- either old_dbdir_name,
- * 		new_dbdir_name, or an empty string which indicates that the
- * 		symbolic link is being created in httpd_conf_dir itself.
+ * Returns a file descriptor that refers to the pre-staged directory, or -1
+ * if there is none.  If adopt is set, the .prestaged-from marker is removed
+ * and new_dbdir_name is populated, so the directory can be used as this
+ * rotation's new database directory.
  */
-static int create_symlink(const int dirfd,
-			  const char *const restrict target,
-			  const char *const restrict name,
-			  const char *const restrict dbdir_name,
-			  const char *const restrict path)
+static int find_prestaged_dir(const int httpd_conf_dirfd,
+			      const int old_nssdb_dirfd, const _Bool adopt)
 {
-	char *new_target;
-	struct stat st;
-	int fd;
+	char marker[NSSDB_DIR_PTN_SIZE + 1];
+	struct dirent *d;
+	int fd, dirfd;
+	ssize_t len;
+	DIR *dir;
 
-	if (*dbdir_name == 0)
-		assert(*path != '/' && *path != 0);
-	else
-		assert(path[0] == '/' && path[1] != 0);
+	dirfd = -1;
 
-	if (symlinkat(target, dirfd, name) < 0) {
-		FATAL("Failed to create symbolic link: %s/%s%s: %m\n",
-		      httpd_conf_dir, dbdir_name, path);
-	}
+	/* Get an independent file descriptor for the directory stream */
+	fd = dup_fd(httpd_conf_dirfd);
 
-	fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_PATH);
-	if (fd < 0) {
-		FATAL("Failed to open symbolic link: %s/%s%s: %m\n",
-		      httpd_conf_dir, dbdir_name, path);
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		FATAL("Failed to open directory stream: %s: %m\n",
+		      httpd_conf_dir);
 	}
 
-	if (fstat(fd, &st) < 0) {
-		FATAL("Failed to read symbolic link info: %s/%s%s: %m\n",
-		      httpd_conf_dir, dbdir_name, path);
-	}
+	while ((errno = 0, d = readdir(dir)) != NULL) {
 
-	if (!S_ISLNK(st.st_mode)) {
-		FATAL("Not a symbolic link: %s/%s%s\n",
-		      httpd_conf_dir, dbdir_name, path);
-	}
+		if (strncmp(d->d_name, NSSDB_DIR_PREFIX, NSSDB_DIR_PFX_LEN)
+					!= 0
+				|| (strlen(d->d_name) != NSSDB_DIR_PTN_LEN
+					&& strlen(d->d_name)
+						!= NSSDB_DIR_OLD_PTN_LEN)
+				|| strcmp(d->d_name, old_dbdir_name) == 0) {
+			continue;
+		}
 
-	if (st.st_size <= 0 || st.st_size > SSIZE_MAX - 1) {
-		FATAL("Symbolic link target size invalid: %s/%s%s\n",
-		      httpd_conf_dir, dbdir_name, path);
-	}
+		dirfd = openat(httpd_conf_dirfd, d->d_name,
+			       O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (dirfd < 0) {
+			FATAL("Failed to open directory: %s/%s: %m\n",
+			      httpd_conf_dir, d->d_name);
+		}
 
-	if ((size_t)st.st_size != strlen(target)) {
-		FATAL("Symbolic link target changed: %s/%s%s\n",
-		      httpd_conf_dir, dbdir_name, path);
-	}
+		fd = openat(dirfd, prestage_marker, O_RDONLY | O_NOFOLLOW);
+		if (fd < 0) {
 
-	new_target = malloc(st.st_size + 1);
-	if (new_target == NULL)
-		FATAL("Memory allocation failed: %m\n");
+			/* Not pre-staged (perhaps a crashed run); skip it */
 
-	memset(new_target, 0, st.st_size + 1);
+			if (errno != ENOENT) {
+				FATAL("Failed to open file: %s/%s/%s: %m\n",
+				      httpd_conf_dir, d->d_name,
+				      prestage_marker);
+			}
 
-	if (readlinkat(fd, "", new_target, st.st_size) < 0) {
-		FATAL("Failed to read symbolic link target: %s/%s%s: %m\n",
-		      httpd_conf_dir, dbdir_name, path);
-	}
+			if (close(dirfd) < 0) {
+				FATAL("Failed to close directory: "
+				      "%s/%s: %m\n",
+				      httpd_conf_dir, d->d_name);
+			}
 
-	if (memcmp(target, new_target, st.st_size) != 0) {
-		FATAL("Symbolic link target changed: %s/%s%s: %m\n",
-		      httpd_conf_dir, dbdir_name, path);
-	}
+			goto next;
+		}
 
-	free(new_target);
+		memset(marker, 0, sizeof marker);
 
-	return fd;
-}
+		len = read(fd, marker, NSSDB_DIR_PTN_LEN);
+		if (len < 0) {
+			FATAL("Failed to read file: %s/%s/%s: %m\n",
+			      httpd_conf_dir, d->d_name, prestage_marker);
+		}
 
-/*
- * Copy ownership, permissions, and (optionally) timestamps from src to dest.
- * (Permissions are not copied for symbolic links.)
- *
- * path:  The path of the source and destination files, relative to the old and
- *	  new mod_nss database directories respectively.  It MUST begin with a /
- * 	  or be an empty string.
- */
-static void copy_metadata(const int src, const int dest,
-			  const char *const restrict path,
-			  const struct stat *const restrict srcst,
-			  const _Bool copy_timestamps)
-{
-	struct timespec times[2];
-	char *sproc, *dproc;
+		if (close(fd) < 0) {
+			FATAL("Failed to close file: %s/%s/%s: %m\n",
+			      httpd_conf_dir, d->d_name, prestage_marker);
+		}
 
-	assert(*path == '/' || *path == 0);
+		if (strcmp(marker, old_dbdir_name) != 0
+				|| !prestaged_dir_fresh(old_nssdb_dirfd,
+							dirfd)) {
 
-	if (fchownat(dest, "", srcst->st_uid, srcst->st_gid, AT_EMPTY_PATH)
-			< 0) {
-		FATAL("Failed to set ownership: %s/%s%s: %m\n",
-		      httpd_conf_dir, new_dbdir_name, path);
-	}
+			INFO("Discarding stale pre-staged directory: "
+			     "%s/%s\n",
+			     httpd_conf_dir, d->d_name);
 
-	if (!S_ISLNK(srcst->st_mode)) {
+			if (close(dirfd) < 0) {
+				FATAL("Failed to close directory: "
+				      "%s/%s: %m\n",
+				      httpd_conf_dir, d->d_name);
+			}
 
-		/*
-		 * Since src doesn't refer to a symlink, it isn't an O_PATH
-		 * file descriptor, and fchmod will work.
-		 */
-		if (fchmod(dest, srcst->st_mode & 07777) < 0) {
-			FATAL("Failed to set permissions: %s/%s%s: %m\n",
-				httpd_conf_dir, new_dbdir_name, path);
+			trash_dbdir(httpd_conf_dirfd, d->d_name);
+			goto next;
 		}
-	}
 
-	/*
-	 * utimensat doesn't accept AT_EMPTY_PATH, so use the links
-	 * in /proc/self/fd/ to achieve the desired effect.
-	 */
+		if (adopt) {
 
-	if (asprintf(&sproc, "/proc/self/fd/%d", src) < 0)
-		FATAL("Failed to format path: /proc/self/fd/%d: %m\n", src);
+			if (unlinkat(dirfd, prestage_marker, 0) < 0) {
+				FATAL("Failed to delete file: %s/%s/%s: %m\n",
+				      httpd_conf_dir, d->d_name,
+				      prestage_marker);
+			}
 
-	if (asprintf(&dproc, "/proc/self/fd/%d", dest) < 0)
-		FATAL("Failed to format path: /proc/self/fd/%d: %m\n", dest);
+			memcpy(new_dbdir_name, d->d_name, NSSDB_DIR_PTN_SIZE);
+		}
 
-	if (copy_timestamps) {
+		break;
 
-		times[0] = srcst->st_atim;
-		times[1] = srcst->st_mtim;
+next:
+		dirfd = -1;
+	}
+	if (dirfd < 0 && errno != 0)
+		FATAL("Failed to read directory: %s: %m\n", httpd_conf_dir);
 
-		if (utimensat(-1, dproc, times, 0) < 0) {
-			FATAL("Failed to set timestamp: %s/%s%s: %m\n",
-				httpd_conf_dir, new_dbdir_name, path);
-		}
+	if (closedir(dir) < 0) {
+		FATAL("Failed to close directory stream: %s: %m\n",
+		      httpd_conf_dir);
 	}
 
-	free(dproc);
-	free(sproc);
+	return dirfd;
 }
 
 /*
- * Atomically update the /etc/httpd/alias symlink.
+ * --prestage: build the next database directory ahead of time (full copy of
+ * the current one, with no certificate changes), recording the source
+ * generation in the .prestaged-from marker file.  A later rotation adopts
+ * the directory and skips the entire copy.
  */
-static void update_nssdb_symlink(const int httpd_conf_dirfd,
-				 const struct stat *const restrict linkst)
+static void run_prestage(void)
 {
-	int fd;
-
-	fd = create_symlink(httpd_conf_dirfd, new_dbdir_name,
-			    "alias.new", "", "alias.new");
+	int httpd_conf_dirfd, old_nssdb_dirfd, new_nssdb_dirfd, fd, lockfd;
+	struct stat linkst;
+	ssize_t written;
+	size_t len;
 
-	if (fchownat(fd, "", linkst->st_uid, linkst->st_gid, AT_EMPTY_PATH)
-			< 0) {
-		FATAL("Failed to set symbolic link ownership: "
-		      "%s/alias.new: %m\n",
-		      httpd_conf_dir);
-	}
+	httpd_conf_dirfd = open(httpd_conf_dir, O_RDONLY | O_DIRECTORY);
+	if (httpd_conf_dirfd < 0)
+		FATAL("Failed to open directory: %s: %m\n", httpd_conf_dir);
 
-	if (close(fd) < 0) {
-		FATAL("Failed to close symbolic link: %s/alias.new: %m\n",
-		      httpd_conf_dir);
-	}
+	lockfd = lock_httpd_conf_dir(httpd_conf_dirfd);
 
-	if (renameat(httpd_conf_dirfd, "alias.new", httpd_conf_dirfd, "alias")
-			< 0) {
-		FATAL("Failed to rename symbolic link: "
-		      "%s/alias.new to %s/alias: %m\n",
-		      httpd_conf_dir, httpd_conf_dir);
-	}
-}
+	old_nssdb_dirfd = old_nssdb_dir(httpd_conf_dirfd, &linkst);
 
+	fd = find_prestaged_dir(httpd_conf_dirfd, old_nssdb_dirfd,
+				/* adopt = */ 0);
+	if (fd >= 0) {
 
-/*******************************************************************************
- *
- *
- * 	Copy contents of old mod_nss database directory to new directory
- *
- *
- ******************************************************************************/
+		NOTICE("Database directory already pre-staged; "
+		       "nothing to do\n");
 
-/*
- * See copy_nssdb_dir().
- *
- * If the named file does not exist in the directory refered to by destdir,
- * it is copied from the directory refered to by srcdir.
- *
- * If the file already exists, only its metadata (ownership and permissions) are
- * copied.
- *
- * path:  The path of the source and destination files, relative to the old and
- *	  new mod_nss database directories respectively.  It MUST begin with a /
- * 	  (and it cannot be an empty string).
- *
- * name:  The name of the source and destination files.  (path always ends with
- * 	  name.)
- */
-static void copy_file(const int srcpfd, const int destdir,
-		      const char *const restrict name,
-		      const char *const restrict path,
-		      const struct stat *const restrict srcst)
-{
-	_Bool copy_timestamps;
-	int src, dest;
+		if (close(fd) < 0) {
+			FATAL("Failed to close directory: %s: %m\n",
+			      httpd_conf_dir);
+		}
+	}
+	else {
+		new_nssdb_dirfd = new_nssdb_dir(httpd_conf_dirfd);
+		copy_nssdb_files(old_nssdb_dirfd, new_nssdb_dirfd);
+		copy_nssdb_dir(old_nssdb_dirfd, new_nssdb_dirfd);
 
-	assert(path[0] == '/' && path[1] != 0);
+		fd = openat(new_nssdb_dirfd, prestage_marker,
+			    O_WRONLY | O_CREAT | O_EXCL, 0640);
+		if (fd < 0) {
+			FATAL("Failed to create file: %s/%s/%s: %m\n",
+			      httpd_conf_dir, new_dbdir_name,
+			      prestage_marker);
+		}
 
-	src = copy_fd(srcpfd, O_RDONLY);
+		len = strlen(old_dbdir_name);
 
-	dest = openat(destdir, name, O_RDWR | O_CREAT | O_EXCL, 0600);
-	if (dest < 0) {
+		written = write(fd, old_dbdir_name, len);
+		if (written < 0) {
+			FATAL("Failed to write file: %s/%s/%s: %m\n",
+			      httpd_conf_dir, new_dbdir_name,
+			      prestage_marker);
+		}
+		if ((size_t)written != len) {
+			FATAL("Failed to write complete file: %s/%s/%s\n",
+			      httpd_conf_dir, new_dbdir_name,
+			      prestage_marker);
+		}
 
-		if (errno != EEXIST) {
-			FATAL("Failed to create file: %s/%s%s: %m\n",
-			      httpd_conf_dir, new_dbdir_name, path);
+		if (close(fd) < 0) {
+			FATAL("Failed to close file: %s/%s/%s: %m\n",
+			      httpd_conf_dir, new_dbdir_name,
+			      prestage_marker);
 		}
 
-		/*
-		 * If the file already exists, assume that it's one of the
-		 * mod_nss database files that was copied earlier.
-		 */
+		sync_new_nssdb_dir(new_nssdb_dirfd);
 
-		dest = openat(destdir, name, O_WRONLY | O_NOFOLLOW);
-		if (dest < 0) {
-			FATAL("Failed to open file: %s/%s%s: %m\n",
-			      httpd_conf_dir, new_dbdir_name, path);
+		if (close(new_nssdb_dirfd) < 0) {
+			FATAL("Failed to close directory: %s/%s: %m\n",
+			      httpd_conf_dir, new_dbdir_name);
 		}
 
-		copy_timestamps = 0;
+		NOTICE("Pre-staged database directory: %s/%s "
+		       "(copied from %s)\n",
+		       httpd_conf_dir, new_dbdir_name, old_dbdir_name);
 	}
-	else {
-		/* Skip leading / in path for copy_file_contents() */
-		copy_file_contents(src, dest, path + 1, srcst);
-		copy_timestamps = 1;
-	}
-
-	copy_metadata(src, dest, path, srcst, copy_timestamps);
 
-	if (close(src) < 0) {
-		FATAL("Failed to close file: %s/%s%s: %m\n",
-		      httpd_conf_dir, old_dbdir_name, path);
+	if (close(old_nssdb_dirfd) < 0) {
+		FATAL("Failed to close directory: %s/%s: %m\n",
+		      httpd_conf_dir, old_dbdir_name);
 	}
 
-	if (close(dest) < 0) {
-		FATAL("Failed to close file: %s/%s%s: %m\n",
-		      httpd_conf_dir, new_dbdir_name, path);
+	if (close(lockfd) < 0) {
+		FATAL("Failed to close file: %s/%s: %m\n",
+		      httpd_conf_dir, lock_file_name);
 	}
+
+	background_purge(httpd_conf_dirfd);
+
+	if (close(httpd_conf_dirfd) < 0)
+		FATAL("Failed to close directory: %s: %m\n", httpd_conf_dir);
 }
 
 /*
- * See copy_nssdb_dir().
- *
- * Create a symbolic link in the directory refered to by destdir.  The link
- * target is copied from the symbolic link refered to by src.
- *
- * See copy_file() for the path and name parameters.
+ * Perform one complete rotation for the hostnames in cert_hostnames.
+ * (Everything main() originally did after argument parsing.)  Returns
+ * whether anything was actually updated; if every requested certificate was
+ * already installed, nothing new was published and no reload is needed.
  */
-static void copy_link(const int src, const int destdir,
-		      const char *const restrict name,
-		      const char *const restrict path,
-		      const struct stat *const restrict srcst)
+/* Defined in the daemon mode section below */
+static void reload_httpd(void);
+
+/*
+ * Reload coordination (--reload).  Each successful rotation touches a
+ * "generation changed" marker under /run/update-mod-nss and forks a
+ * debouncer child that sleeps for the reload window and then reloads httpd
+ * -- unless the marker has been touched again in the meantime, in which
+ * case the newer rotation's child owns the reload.  A renewal wave of many
+ * domains therefore triggers one reload, not one per certificate.
+ */
+static void request_httpd_reload(void)
 {
-	char *target;
-	int dest;
+	struct stat st;
+	int fd, lockfd;
+	pid_t pid;
 
-	assert(path[0] == '/' && path[1] != 0);
+	if (mkdir(run_dir, 0755) < 0 && errno != EEXIST)
+		FATAL("Failed to create directory: %s: %m\n", run_dir);
 
-	if (srcst->st_size <= 0 || srcst->st_size > SSIZE_MAX - 1) {
-		FATAL("Symbolic link target size invalid: %s/%s%s\n",
-		      httpd_conf_dir, old_dbdir_name, path);
-	}
+	fd = open(reload_marker, O_WRONLY | O_CREAT | O_NOFOLLOW, 0644);
+	if (fd < 0)
+		FATAL("Failed to create file: %s: %m\n", reload_marker);
 
-	target = malloc(srcst->st_size + 1);
-	if (target == NULL)
-		FATAL("Memory allocation failed: %m\n");
+	if (futimens(fd, NULL) < 0)
+		FATAL("Failed to update timestamps: %s: %m\n", reload_marker);
 
-	memset(target, 0, srcst->st_size + 1);
+	if (close(fd) < 0)
+		FATAL("Failed to close file: %s: %m\n", reload_marker);
 
-	if (readlinkat(src, "", target, srcst->st_size) < 0) {
-		FATAL("Failed to read symbolic link target: %s/%s%s: %m\n",
-		      httpd_conf_dir, old_dbdir_name, path);
+	log_flush();
+
+	pid = fork();
+	if (pid < 0)
+		FATAL("Failed to fork reload process: %m\n");
+
+	if (pid != 0) {
+		DEBUG("Debouncing httpd reload in background process %ld\n",
+		      (long)pid);
+		return;
 	}
 
-	dest = create_symlink(destdir, target, name, new_dbdir_name, path);
+	sleep(reload_window);
 
-	copy_metadata(src, dest, path, srcst, /* copy_timestamps = */ 1);
+	/* Serialize with other instances' debouncer children */
+	lockfd = open(reload_lock, O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+	if (lockfd < 0)
+		FATAL("Failed to open file: %s: %m\n", reload_lock);
 
-	if (close(dest) < 0) {
-		FATAL("Failed to close symbolic link: %s/%s%s: %m\n",
-		      httpd_conf_dir, new_dbdir_name, path);
+	if (flock(lockfd, LOCK_EX) < 0)
+		FATAL("Failed to lock file: %s: %m\n", reload_lock);
+
+	if (stat(reload_marker, &st) < 0) {
+
+		if (errno != ENOENT)
+			FATAL("Failed to read file info: %s: %m\n",
+			      reload_marker);
+
+		/* Another child already reloaded for this wave */
+		log_flush();
+		_exit(EXIT_SUCCESS);
 	}
 
-	free(target);
-}
+	if (st.st_mtime + (time_t)reload_window > time(NULL)) {
 
-/* Forward declaration for recursive call */
-static void copy_dir_contents(int, int, const char *);
+		/* A newer rotation re-armed the debounce; its child owns it */
+		DEBUG("Reload re-armed by a newer rotation; standing down\n");
+		log_flush();
+		_exit(EXIT_SUCCESS);
+	}
+
+	if (unlink(reload_marker) < 0)
+		FATAL("Failed to delete file: %s: %m\n", reload_marker);
+
+	reload_httpd();
+
+	log_flush();
+	_exit(EXIT_SUCCESS);
+}
 
 /*
- * See copy_nssdb_dir().
- *
- * Copy the named subdirectory from srcdir to destdir.
- *
- * See copy_file() for the path and name parameters.
+ * The big tree copy (copy_nssdb_dir) depends only on the old database
+ * directory, not on the NSS certificate work, so it runs on its own thread
+ * overlapped with the NSS phase and is joined before the new directory is
+ * published.  The thread keeps running as root while the main thread drops
+ * to the NSS user with per-thread credentials (set_thread_effective_user).
  */
-static void copy_subdir(const int srcpfd, const int destdir,
-			const char *const restrict name,
-			const char *const restrict path,
-			const struct stat *const restrict srcst)
+static struct {
+	pthread_t	thread;
+	int		srcdir;
+	int		destdir;
+	int64_t		ns;
+} nssdb_copy;
+
+static void *nssdb_copy_thread(void *const arg __attribute__((unused)))
 {
-	int src, dest;
+	struct timespec start, end;
 
-	assert(path[0] == '/' && path[1] != 0);
+	if (clock_gettime(CLOCK_MONOTONIC, &start) < 0)
+		FATAL("Failed to read monotonic clock: %m\n");
 
-	src = copy_fd(srcpfd, O_RDONLY | O_DIRECTORY);
+	copy_nssdb_dir(nssdb_copy.srcdir, nssdb_copy.destdir);
 
-	if (mkdirat(destdir, name, 0700) < 0) {
-		FATAL("Failed to create directory: %s/%s%s: %m\n",
-		      httpd_conf_dir, new_dbdir_name, path);
-	}
+	if (clock_gettime(CLOCK_MONOTONIC, &end) < 0)
+		FATAL("Failed to read monotonic clock: %m\n");
 
-	dest = openat(destdir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
-	if (dest < 0) {
-		FATAL("Failed to open directory: %s/%s%s: %m\n",
-		      httpd_conf_dir, new_dbdir_name, path);
-	}
+	nssdb_copy.ns = (int64_t)(end.tv_sec - start.tv_sec) * 1000000000
+			+ (end.tv_nsec - start.tv_nsec);
 
-	copy_dir_contents(src, dest, path);
-	copy_metadata(src, dest, path, srcst, /* copy_timestamps = */ 1);
+	return NULL;
+}
 
-	if (close(src) < 0) {
-		FATAL("Failed to close directory: %s/%s%s: %m\n",
-		      httpd_conf_dir, old_dbdir_name, path);
-	}
+static void nssdb_copy_start(const int srcdir, const int destdir)
+{
+	int err;
 
-	if (close(dest) < 0) {
-		FATAL("Failed to close directory: %s/%s%s: %m\n",
-		      httpd_conf_dir, new_dbdir_name, path);
-	}
+	nssdb_copy.srcdir = srcdir;
+	nssdb_copy.destdir = destdir;
+
+	err = pthread_create(&nssdb_copy.thread, NULL, nssdb_copy_thread,
+			     NULL);
+	if (err != 0)
+		FATAL("Failed to create copy thread: %s\n", strerror(err));
 }
 
-/*
- * See copy_nssdb_dir().
- *
- * Copy the contents of the directory refered to by srcdir to the directory
- * refered to by by destdir.
- *
- * subdir is the path to srcdir and destdir, relative to old_nssdb_dir and
- * new_nssdb_dir respectively.
- *
- * subdir:  The path of the source and destination directories, relative to the
- * 	    old and new mod_nss database directories respectively.  It MUST
- * 	    begin with a / or be an empty string.
- */
-static void copy_dir_contents(const int srcdir, const int destdir,
-			      const char *const subdir)
+static void nssdb_copy_join(void)
 {
-	struct dirent *d;
-	struct stat st;
-	int dirfd, src;
-	char *path;
-	DIR *sdir;
+	int err;
 
-	assert(*subdir == '/' || *subdir == 0);
+	err = pthread_join(nssdb_copy.thread, NULL);
+	if (err != 0)
+		FATAL("Failed to join copy thread: %s\n", strerror(err));
 
-	/* Get an independent file descriptor for the directory stream */
-	dirfd = copy_fd(srcdir, O_RDONLY | O_DIRECTORY);
+	timing_add("copy_nssdb_dir", nssdb_copy.ns);
+}
 
-	sdir = fdopendir(dirfd);
-	if (sdir == NULL) {
-		FATAL("Failed to open directory stream: %s/%s%s: %m\n",
-		      httpd_conf_dir, old_dbdir_name, subdir);
-	}
+static _Bool run_update(void)
+{
+	int httpd_conf_dirfd, new_nssdb_dirfd, old_nssdb_dirfd, lockfd;
+	CERTCertificate *cert;
+	PK11SlotInfo *slot;
+	struct stat linkst;
+	_Bool prestaged;
+	uid_t saved_uid;
+	gid_t saved_gid;
+	unsigned int h;
+
+	httpd_conf_dirfd = open(httpd_conf_dir, O_RDONLY | O_DIRECTORY);
+	if (httpd_conf_dirfd < 0)
+		FATAL("Failed to open directory: %s: %m\n", httpd_conf_dir);
 
-	while ((errno = 0, d = readdir(sdir)) != NULL) {
+	lockfd = lock_httpd_conf_dir(httpd_conf_dirfd);
 
-		if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
-			continue;
+	/*
+	 * Absorb any renewals that arrived (or that concurrent instances were
+	 * started for) while we waited for the lock; those instances will find
+	 * their certificates already installed and exit without rotating.
+	 */
+	if (!daemon_mode)
+		scan_acme_cert_dir();
+
+	timing_begin("old_nssdb_dir");
+	old_nssdb_dirfd = old_nssdb_dir(httpd_conf_dirfd, &linkst);
+	timing_finish();
+
+	saved_uid = geteuid();
+	saved_gid = getegid();
+	set_effective_user(nss_uid, nss_gid);
 
-		if (asprintf(&path, "%s/%s", subdir, d->d_name) < 0) {
-			FATAL("Failed to format path: %s/%s: %m\n",
-			      subdir, d->d_name);
+	if (check_installed_certs(old_nssdb_dirfd)) {
+
+		NOTICE("All requested certificates already installed; "
+		       "nothing to do\n");
+
+		if (!daemon_mode) {
+			PL_ArenaFinish();
+			if (PR_Cleanup() != PR_SUCCESS)
+				NSS_FATAL("Failed to shut down NSPR "
+					  "library\n");
 		}
 
-		src = openat(srcdir, d->d_name,
-			     O_RDONLY  | O_NOFOLLOW | O_PATH);
-		if (src < 0) {
-			FATAL("Failed to open file: %s/%s%s: %m\n",
-			      httpd_conf_dir, old_dbdir_name, path);
+		set_effective_user(saved_uid, saved_gid);
+
+		if (close(old_nssdb_dirfd) < 0) {
+			FATAL("Failed to close directory: %s/%s: %m\n",
+			      httpd_conf_dir, old_dbdir_name);
 		}
 
-		if (fstat(src, &st) < 0) {
-			FATAL("Failed to read file info: %s/%s%s: %m\n",
-			      httpd_conf_dir, old_dbdir_name, path);
+		if (close(lockfd) < 0) {
+			FATAL("Failed to close file: %s/%s: %m\n",
+			      httpd_conf_dir, lock_file_name);
 		}
 
-		switch (st.st_mode & S_IFMT) {
+		if (close(httpd_conf_dirfd) < 0) {
+			FATAL("Failed to close directory: %s: %m\n",
+			      httpd_conf_dir);
+		}
 
-			case S_IFREG:
-				copy_file(src, destdir, d->d_name, path, &st);
-				break;
+		timing_report();
 
-			case S_IFLNK:
-				copy_link(src, destdir, d->d_name, path, &st);
-				break;
+		log_flush();
 
-			case S_IFDIR:
-				copy_subdir(src, destdir, d->d_name, path, &st);
-				break;
+		return 0;
+	}
 
-			default:
-				FATAL("Unsupported file type: %s/%s%s\n",
-				      httpd_conf_dir, old_dbdir_name, path);
-		}
+	set_effective_user(saved_uid, saved_gid);
 
-		if (close(src) < 0) {
-			FATAL("Failed to close file: %s/%s%s: %m\n",
-			      httpd_conf_dir, old_dbdir_name, path);
+	if (inplace_mode) {
+
+		if (!nssdb_sql) {
+			FATAL("--inplace requires the SQLite (cert9) "
+			      "database backend: %s/%s\n",
+			      httpd_conf_dir, old_dbdir_name);
 		}
 
-		free(path);
+		/*
+		 * SQLite updates are transactional, so the live database can
+		 * be modified in place; the update phase below logs the
+		 * directory as new_dbdir_name, which in this mode is the
+		 * same directory.
+		 */
+		INFO("Updating database in place: %s/%s\n",
+		     httpd_conf_dir, old_dbdir_name);
+		memcpy(new_dbdir_name, old_dbdir_name, NSSDB_DIR_PTN_SIZE);
+		new_nssdb_dirfd = old_nssdb_dirfd;
+		prestaged = 1;
 	}
-	if (errno != 0) {
-		FATAL("Failed to read directory: %s/%s%s: %m\n",
-		      httpd_conf_dir, old_dbdir_name, subdir);
+	else if ((new_nssdb_dirfd = find_prestaged_dir(httpd_conf_dirfd,
+						       old_nssdb_dirfd,
+						       /* adopt = */ 1))
+			>= 0) {
+		prestaged = 1;
+		INFO("Using pre-staged database directory: %s/%s\n",
+		     httpd_conf_dir, new_dbdir_name);
+	}
+	else {
+		prestaged = 0;
+		new_nssdb_dirfd = new_nssdb_dir(httpd_conf_dirfd);
+		timing_begin("copy_nssdb_files");
+		copy_nssdb_files(old_nssdb_dirfd, new_nssdb_dirfd);
+		timing_finish();
 	}
 
-	if (closedir(sdir) < 0) {
-		FATAL("Failed to close directory stream: %s/%s%s: %m\n",
-		      httpd_conf_dir, old_dbdir_name, subdir);
+	/* Overlap the tree copy with the NSS certificate work below */
+	if (!prestaged)
+		nssdb_copy_start(old_nssdb_dirfd, new_nssdb_dirfd);
+
+	set_thread_effective_user(nss_uid, nss_gid);
+
+	timing_begin("init_libnss");
+	slot = init_libnss(new_nssdb_dirfd);
+	timing_finish();
+
+	timing_begin("update_certs");
+	for (h = 0; h < num_cert_hostnames; ++h) {
+		cert_hostname = cert_hostnames[h];
+		cert = new_certificate();
+		remove_old_certs();
+		add_new_cert(slot, cert);
+		CERT_DestroyCertificate(cert);
 	}
-}
+	timing_finish();
 
-/*
- * Recursively copies the contents of the directory refered to by srcdir
- * (old_dbdir_name) to the directory refered to by destdir (new_dbdir_name).
- * Ownership, permissions, and SELinux contexts are also copied.  Timestamps
- * (atime and mtime) are copied for files that don't already exist in the
- * destination directory.
- *
- * Files that already exist in the destination directory (NSS database files)
- * are not overwritten, nor are their timestamps modified.  Ownership,
- * permissions, and SELinux contexts ARE copied from the corresponding file in
- * the source directory.
- *
- * Only regular files, symbolic links, and subdirectories may exist in the
- * source directory; the presence of any other type of filesystem object is a
- * fatal error.  The presence of any pre-existing filesystem object other than
- * a regular file in the destination directory is also a fatal error (if its
- * relative path matches that of an object in the source directory).
- *
- * Call graph:
- *
- *   copy_nssdb_dir
- *     │
- *     └─> copy_dir_contents <──────────┐
- *          │                           │
- *          ├─> copy_subdir ────────────┘
- *          │
- *          ├─> copy_file
- *          │
- *          └─> copy_link
- */
-static void copy_nssdb_dir(const int srcdir, const int destdir)
-{
-	struct stat srcst;
+	shutdown_libnss(slot);
 
-	copy_dir_contents(srcdir, destdir, "");
+	set_thread_effective_user(saved_uid, saved_gid);
 
-	if (fstat(srcdir, &srcst) < 0) {
-		FATAL("Failed to read directory info: %s/%s: %m\n",
+	if (!prestaged)
+		nssdb_copy_join();
+
+	sync_new_nssdb_dir(new_nssdb_dirfd);
+
+	if (!inplace_mode) {
+
+		update_nssdb_symlink(httpd_conf_dirfd, &linkst);
+
+		sync_httpd_conf_dir(httpd_conf_dirfd);
+
+		timing_begin("trash_old_nssdb_dir");
+		trash_old_nssdb_dir(httpd_conf_dirfd);
+		timing_finish();
+
+		if (close(new_nssdb_dirfd) < 0) {
+			FATAL("Failed to close directory: %s/%s: %m\n",
+			      httpd_conf_dir, new_dbdir_name);
+		}
+	}
+
+	if (close(old_nssdb_dirfd) < 0) {
+		FATAL("Failed to close directory: %s/%s: %m\n",
 		      httpd_conf_dir, old_dbdir_name);
 	}
 
-	copy_metadata(srcdir, destdir, "", &srcst, /* copy_timestamps = */ 0);
+	/*
+	 * Release the rotation lock before forking the reload debouncer;
+	 * the child would otherwise inherit lockfd and hold the flock for
+	 * its entire sleep, serializing the rest of the renewal wave.
+	 */
+	if (close(lockfd) < 0) {
+		FATAL("Failed to close file: %s/%s: %m\n",
+		      httpd_conf_dir, lock_file_name);
+	}
+
+	/* The daemon reloads httpd itself, once per batch */
+	if (reload_mode && !daemon_mode)
+		request_httpd_reload();
+
+	/* Fold the per-rotation counters into the totals before the reset */
+	metrics_rotation_complete();
+
+	timing_report();
+
+	metrics_write();
+
+	background_purge(httpd_conf_dirfd);
+
+	if (close(httpd_conf_dirfd) < 0)
+		FATAL("Failed to close directory: %s: %m\n", httpd_conf_dir);
+
+	/* In daemon mode, don't sit on buffered records until the next batch */
+	log_flush();
+
+	return 1;
 }
 
 
 /*******************************************************************************
  *
  *
- * 	Delete the old mod_nss database directory
+ * 	Daemon mode (--daemon)
  *
  *
  ******************************************************************************/
 
 /*
- * See delete_old_nssdb_dir().
- *
- * Deletes all files, symbolic links, and subdirectories in the directory
- * refered to by dirfd.
- *
- * subdir:  The path of the directory refered to by dirfd, relative to the old
- * 	    mod_nss database directory.  It MUST begin with a / or be an empty
- * 	    string.
+ * Reap any exited background children (trash purgers, reload debouncers).
+ * In one-shot mode they reparent to init when the program exits, but the
+ * daemon lives forever, so without this every batch would leave a zombie.
  */
-static void delete_dir_contents(const int dirfd,
-				const char *const restrict subdir)
+static void reap_children(void)
 {
-	struct dirent *d;
-	struct stat st;
-	int fd, flags;
-	char *path;
-	DIR *dir;
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+		;
+}
+
+/*
+ * Reload httpd after a rotation.  In one-shot mode this is the systemd
+ * unit's ExecStartPost job; in daemon mode no unit exits, so the daemon has
+ * to do it itself.
+ */
+static void reload_httpd(void)
+{
+	int status;
+
+	status = system(reload_cmd);
+	if (status < 0)
+		FATAL("Failed to run command: %s: %m\n", reload_cmd);
+	if (status != 0)
+		FATAL("Command failed (status %d): %s\n", status, reload_cmd);
+
+	INFO("Reloaded httpd\n");
+}
+
+/*
+ * Scan /var/lib/acme and process all pending certificates in a single
+ * rotation, then clean up the ${HOSTNAME}.new symlinks (which the one-shot
+ * systemd template normally removes) and reload httpd.
+ */
+static void process_pending_certs(void)
+{
+	const char **hostnames;
+	unsigned int h, count;
+	char *newlink;
+	_Bool updated;
+
+	num_cert_hostnames = 0;
+	scan_acme_cert_dir();
+	if (num_cert_hostnames == 0)
+		return;
+
+	NOTICE("Processing %u new certificate(s)\n", num_cert_hostnames);
+
+	/*
+	 * check_installed_certs() prunes cert_hostnames, so keep a full copy
+	 * for the symlink cleanup below.
+	 */
+
+	count = num_cert_hostnames;
+
+	hostnames = malloc(count * sizeof *hostnames);
+	if (hostnames == NULL)
+		FATAL("Memory allocation failed: %m\n");
+
+	memcpy(hostnames, cert_hostnames, count * sizeof *hostnames);
+
+	updated = run_update();
+
+	for (h = 0; h < count; ++h) {
+
+		if (asprintf(&newlink, "%s/%s.new", acme_cert_dir,
+			     hostnames[h]) < 0) {
+			FATAL("Failed to format path: %s/%s.new: %m\n",
+			      acme_cert_dir, hostnames[h]);
+		}
+
+		if (unlink(newlink) < 0 && errno != ENOENT)
+			FATAL("Failed to delete symbolic link: %s: %m\n",
+			      newlink);
+
+		free(newlink);
+		free((char *)hostnames[h]);
+	}
+
+	free(hostnames);
+	free(cert_hostnames);
+	cert_hostnames = NULL;
+	num_cert_hostnames = 0;
+
+	/* Stale .new retries are cleaned up above but don't churn httpd */
+	if (updated)
+		reload_httpd();
+}
+
+/*
+ * Watch /var/lib/acme with inotify and batch renewals that arrive within
+ * batch_window seconds into a single rotation.  Never returns.
+ */
+static void __attribute__((noreturn)) run_daemon(void)
+{
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	struct timespec now, deadline;
+	struct pollfd pfd;
+	ssize_t len;
+	int ifd, ms;
+
+	ifd = inotify_init1(IN_CLOEXEC);
+	if (ifd < 0)
+		FATAL("Failed to create inotify instance: %m\n");
+
+	if (inotify_add_watch(ifd, acme_cert_dir,
+			      IN_CREATE | IN_MOVED_TO) < 0) {
+		FATAL("Failed to watch directory: %s: %m\n", acme_cert_dir);
+	}
 
-	assert(*subdir == '/' || *subdir == 0);
+	NOTICE("Watching %s for new certificates\n", acme_cert_dir);
 
-	/* Get an independent file descriptor for the directory stream */
-	fd = copy_fd(dirfd, O_RDONLY | O_DIRECTORY);
+	/* Service anything that arrived while the daemon wasn't running */
+	process_pending_certs();
+	reap_children();
 
-	dir = fdopendir(fd);
-	if (dir == NULL) {
-		FATAL("Failed to open directory stream: %s/%s%s: %m\n",
-		      httpd_conf_dir, old_dbdir_name, subdir);
-	}
+	pfd.fd = ifd;
+	pfd.events = POLLIN;
 
-	while ((errno = 0, d = readdir(dir)) != NULL) {
+	for (;;) {
 
-		if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
-			continue;
+		/* Block until something happens in the directory ... */
 
-		if (asprintf(&path, "%s/%s", subdir, d->d_name) < 0) {
-			FATAL("Failed to format path: %s/%s: %m\n",
-			      subdir, d->d_name);
+		len = read(ifd, buf, sizeof buf);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			FATAL("Failed to read inotify events: %m\n");
 		}
 
-		fd = openat(dirfd, d->d_name, O_RDONLY  | O_NOFOLLOW | O_PATH);
-		if (fd < 0) {
-			FATAL("Failed to open file: %s/%s%s: %m\n",
-			      httpd_conf_dir, old_dbdir_name, path);
-		}
+		/* ... then drain further events until the window expires */
 
-		if (fstat(fd, &st) < 0) {
-			FATAL("Failed to read file info: %s/%s%s: %m\n",
-			      httpd_conf_dir, old_dbdir_name, path);
-		}
+		if (clock_gettime(CLOCK_MONOTONIC, &deadline) < 0)
+			FATAL("Failed to read monotonic clock: %m\n");
+		deadline.tv_sec += batch_window;
 
-		if (S_ISDIR(st.st_mode)) {
-			delete_dir_contents(fd, path);
-			flags = AT_REMOVEDIR;
-		}
-		else {
-			flags = 0;
-		}
+		for (;;) {
 
-		if (unlinkat(dirfd, d->d_name, flags) < 0) {
-			FATAL("Failed to delete file: %s/%s%s: %m\n",
-			      httpd_conf_dir, old_dbdir_name, path);
-		}
+			if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+				FATAL("Failed to read monotonic clock: %m\n");
 
-		if (close(fd) < 0) {
-			FATAL("Failed to close file: %s/%s%s: %m\n",
-			      httpd_conf_dir, old_dbdir_name, path);
-		}
+			ms = (deadline.tv_sec - now.tv_sec) * 1000
+				+ (deadline.tv_nsec - now.tv_nsec) / 1000000;
+			if (ms <= 0)
+				break;
 
-		free(path);
-	}
-	if (errno != 0) {
-		FATAL("Failed to read directory: %s/%s%s: %m\n",
-		      httpd_conf_dir, old_dbdir_name, subdir);
-	}
+			switch (poll(&pfd, 1, ms)) {
 
-	if (closedir(dir) < 0) {
-		FATAL("Failed to close directory stream: %s/%s%s: %m\n",
-		      httpd_conf_dir, old_dbdir_name, subdir);
-	}
-}
+				case -1:
+					if (errno == EINTR)
+						continue;
+					FATAL("Failed to poll inotify: %m\n");
 
-/*
- * Recursively deletes the old NSS database directory.
- */
-static void delete_old_nssdb_dir(const int httpd_conf_dirfd,
-				 const int old_nssdb_dirfd)
-{
-	delete_dir_contents(old_nssdb_dirfd, "");
+				case 0:
+					ms = 0;
+					break;
 
-	if (unlinkat(httpd_conf_dirfd, old_dbdir_name, AT_REMOVEDIR) < 0) {
-		FATAL("Failed to remove directory: %s/%s: %m\n",
-		      httpd_conf_dir, old_dbdir_name);
+				default:
+					len = read(ifd, buf, sizeof buf);
+					if (len < 0 && errno != EINTR) {
+						FATAL("Failed to read inotify "
+						      "events: %m\n");
+					}
+			}
+
+			if (ms == 0)
+				break;
+		}
+
+		process_pending_certs();
+		reap_children();
 	}
 }
 
@@ -1141,279 +4914,342 @@ static void delete_old_nssdb_dir(const int httpd_conf_dirfd,
 /*******************************************************************************
  *
  *
- * 	mod_nss database stuff
+ * 	Benchmark mode (--bench)
  *
  *
  ******************************************************************************/
 
-static PK11SlotInfo *init_libnss(const int new_nssdb_dirfd)
-{
-	PK11SlotInfo *slot;
+/*
+ * Fabricates a synthetic alias-* tree in a scratch directory (mkdtemp), runs
+ * the copy and delete engines against it, and reports throughput and per-file
+ * copy latency.  Nothing under /etc/httpd is touched, so the effect of
+ * --link/--jobs/--uring (or a code change) can be measured without risking a
+ * production database directory.
+ */
 
-	if (fchdir(new_nssdb_dirfd) < 0) {
-		FATAL("Failed to change directory: %s/%s: %m\n",
-		      httpd_conf_dir, new_dbdir_name);
-	}
+/* Per-file copy latencies (in nanoseconds), recorded by copy_file() */
+static pthread_mutex_t bench_latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int64_t *bench_latencies;
+static unsigned int num_bench_latencies;
+static unsigned int bench_latency_capacity;
 
-	if (NSS_InitReadWrite(".") != SECSuccess) {
-		NSS_FATAL("Failed to open NSS database: %s/%s\n",
-			  httpd_conf_dir, new_dbdir_name);
-	}
+static int64_t bench_elapsed_ns(const struct timespec *const start)
+{
+	struct timespec now;
 
-	slot = PK11_GetInternalKeySlot();
-	if (slot == NULL) {
-		NSS_FATAL("Failed to open NSS database slot: %s/%s\n",
-			  httpd_conf_dir, new_dbdir_name);
-	}
+	if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+		FATAL("Failed to read monotonic clock: %m\n");
 
-	if (!PK11_IsFriendly(slot)) {
-		FATAL("NSS database requires authentication: %s/%s\n",
-		      httpd_conf_dir, new_dbdir_name);
-	}
+	return (int64_t)(now.tv_sec - start->tv_sec) * 1000000000
+		+ (now.tv_nsec - start->tv_nsec);
+}
 
-	return slot;
+static void bench_file_begin(struct timespec *const start)
+{
+	if (!bench_mode)
+		return;
+
+	if (clock_gettime(CLOCK_MONOTONIC, start) < 0)
+		FATAL("Failed to read monotonic clock: %m\n");
 }
 
-static void shutdown_libnss(PK11SlotInfo *const slot)
+/* copy_file() may run on worker threads, so the sample list is locked */
+static void bench_file_finish(const struct timespec *const start)
 {
-	PK11_FreeSlot(slot);
+	int64_t *latencies, ns;
+	int err;
 
-	if (NSS_Shutdown() != SECSuccess) {
-		NSS_FATAL("Failed to close NSS database: %s/%s\n",
-			  httpd_conf_dir, new_dbdir_name);
+	if (!bench_mode)
+		return;
+
+	ns = bench_elapsed_ns(start);
+
+	err = pthread_mutex_lock(&bench_latency_mutex);
+	if (err != 0)
+		FATAL("Failed to lock benchmark mutex: %s\n", strerror(err));
+
+	if (num_bench_latencies == bench_latency_capacity) {
+
+		bench_latency_capacity = bench_latency_capacity == 0 ?
+				1024 : bench_latency_capacity * 2;
+
+		latencies = realloc(bench_latencies,
+				    bench_latency_capacity
+						* sizeof *bench_latencies);
+		if (latencies == NULL)
+			FATAL("Memory allocation failed: %m\n");
+
+		bench_latencies = latencies;
 	}
 
-	PL_ArenaFinish();
+	bench_latencies[num_bench_latencies++] = ns;
 
-	if (PR_Cleanup() != PR_SUCCESS)
-		NSS_FATAL("Failed to shut down NSPR library\n");
+	err = pthread_mutex_unlock(&bench_latency_mutex);
+	if (err != 0)
+		FATAL("Failed to unlock benchmark mutex: %s\n", strerror(err));
 }
 
-static CERTCertificate *new_certificate(void)
+/* Deterministic pseudo-random size (0 - 8191 bytes) for the i'th file */
+static size_t bench_file_size(const unsigned int i)
 {
-	CERTCertificate *cert;
-	char *cert_file, *pem;
-	ssize_t bytes_read;
-	struct stat st;
-	int fd;
+	return (size_t)(i * 2654435761U) % 8192;
+}
 
-	if (asprintf(&cert_file, "%s/%s.crt", acme_cert_dir, cert_hostname)
-			< 0) {
-		FATAL("Failed to format path: %s/%s.crt: %m\n",
-		      acme_cert_dir, cert_hostname);
-	}
+static void bench_write_file(const int dirfd, const char *const name,
+			     size_t size)
+{
+	/* Content doesn't matter, so write zeroes */
+	static const char buf[64 * 1024];
 
-	fd = open(cert_file, O_RDONLY);
+	ssize_t written;
+	size_t chunk;
+	int fd;
+
+	fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL, 0644);
 	if (fd < 0)
-		FATAL("Failed to open file: %s: %m\n", cert_file);
+		FATAL("Failed to create file: %s: %m\n", name);
 
-	if (fstat(fd, &st) < 0)
-		FATAL("Failed to read file info: %s: %m\n", cert_file);
+	while (size > 0) {
 
-	if (st.st_size <= 0 || st.st_size > SSIZE_MAX)
-		FATAL("File size invalid: %s\n", cert_file);
+		chunk = size < sizeof buf ? size : sizeof buf;
 
-	pem = malloc(st.st_size);
-	if (pem == NULL)
-		FATAL("Memory allocation failed: %m\n");
+		written = write(fd, buf, chunk);
+		if (written < 0)
+			FATAL("Failed to write file: %s: %m\n", name);
 
-	bytes_read = read(fd, pem, st.st_size);
-	if (bytes_read < 0)
-		FATAL("Failed to read file: %s: %m\n", cert_file);
-	if (bytes_read != st.st_size)
-		FATAL("Failed to read complete file: %s\n", cert_file);
+		size -= written;
+	}
 
 	if (close(fd) < 0)
-		FATAL("Failed to close file: %s: %m\n", cert_file);
+		FATAL("Failed to close file: %s: %m\n", name);
+}
 
-	cert = CERT_DecodeCertFromPackage(pem, st.st_size);
-	if (cert == NULL)
-		NSS_FATAL("Failed to parse certificate: %s\n", cert_file);
+/*
+ * Creates the synthetic source tree (under the scratch directory refered to
+ * by rootfd) and returns a file descriptor that refers to it.  The tree
+ * matches the shape of a real alias directory -- a few large database files,
+ * many small files, a few subdirectories, and a few symbolic links.
+ */
+static int bench_create_tree(const int rootfd)
+{
+	char name[32];
+	unsigned int i, s;
+	int srcfd, subfd, fd;
 
-	free(pem);
-	free(cert_file);
+	if (mkdirat(rootfd, old_dbdir_name, 0755) < 0)
+		FATAL("Failed to create directory: %s: %m\n", old_dbdir_name);
 
-	return cert;
-}
+	srcfd = openat(rootfd, old_dbdir_name, O_RDONLY | O_DIRECTORY);
+	if (srcfd < 0)
+		FATAL("Failed to open directory: %s: %m\n", old_dbdir_name);
 
-static const char *format_not_after(const CERTCertificate *const cert)
-{
-	static const char time_format[] = "%a %b %d %H:%M:%S %Y UTC";
-	static char buf[100];
+	/* The databases dominate a real alias directory */
+	bench_write_file(srcfd, "cert8.db", 512 * 1024);
+	bench_write_file(srcfd, "key3.db", 64 * 1024);
+	bench_write_file(srcfd, "secmod.db", 16 * 1024);
 
-	PRExplodedTime etime;
-	PRTime prtime;
+	/* A mostly-hole file, to exercise the sparse copy path */
+	bench_write_file(srcfd, "sparse.dat", 64 * 1024);
 
-	if (cert->validity.notAfter.type == siUTCTime) {
+	fd = openat(srcfd, "sparse.dat", O_WRONLY);
+	if (fd < 0)
+		FATAL("Failed to open file: sparse.dat: %m\n");
 
-		if (DER_UTCTimeToTime(&prtime, &cert->validity.notAfter)
-				!= SECSuccess) {
-			NSS_FATAL("Failed to decode ASN.1 time "
-				  "in certificate for %s\n",
-				  cert->nickname);
-		}
+	if (ftruncate(fd, 8 * 1024 * 1024) < 0)
+		FATAL("Failed to set file size: sparse.dat: %m\n");
+
+	if (close(fd) < 0)
+		FATAL("Failed to close file: sparse.dat: %m\n");
+
+	for (i = 0; i < bench_num_files; ++i) {
+		snprintf(name, sizeof name, "file-%06u", i);
+		bench_write_file(srcfd, name, bench_file_size(i));
 	}
-	else if (cert->validity.notAfter.type == siGeneralizedTime) {
 
-		if (DER_GeneralizedTimeToTime(&prtime, &cert->validity.notAfter)
-				!= SECSuccess) {
-			NSS_FATAL("Failed to decode ASN.1 time "
-				  "in certificate for %s\n",
-				  cert->nickname);
+	for (s = 0; s < bench_num_subdirs; ++s) {
+
+		snprintf(name, sizeof name, "subdir-%03u", s);
+
+		if (mkdirat(srcfd, name, 0755) < 0)
+			FATAL("Failed to create directory: %s: %m\n", name);
+
+		subfd = openat(srcfd, name, O_RDONLY | O_DIRECTORY);
+		if (subfd < 0)
+			FATAL("Failed to open directory: %s: %m\n", name);
+
+		for (i = 0; i < bench_num_files / 10; ++i) {
+			snprintf(name, sizeof name, "file-%06u", i);
+			bench_write_file(subfd, name, bench_file_size(i));
 		}
+
+		if (close(subfd) < 0)
+			FATAL("Failed to close directory: %m\n");
 	}
-	else {
-		FATAL("Unknown ASN.1 time type in certificate for %s\n",
-		      cert->nickname);
+
+	for (i = 0; i < bench_num_links; ++i) {
+
+		snprintf(name, sizeof name, "link-%03u", i);
+
+		if (symlinkat("cert8.db", srcfd, name) < 0) {
+			FATAL("Failed to create symbolic link: %s: %m\n",
+			      name);
+		}
 	}
 
-	PR_ExplodeTime(prtime, PR_GMTParameters, &etime);
-	PR_FormatTime(buf, sizeof buf, time_format, &etime);
+	return srcfd;
+}
 
-	return buf;
+static int bench_latency_cmp(const void *const a, const void *const b)
+{
+	const int64_t x = *(const int64_t *)a;
+	const int64_t y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
 }
 
-static void remove_old_certs(PK11SlotInfo *const slot)
+static void run_bench(void)
 {
-	CERTCertListNode *node;
-	CERTCertList *list;
-	unsigned deleted;
+	char scratch[] = "/tmp/update-mod-nss-bench.XXXXXX";
 
-	list = PK11_ListCertsInSlot(slot);
-	if (list == NULL) {
-		NSS_FATAL("Failed to read certificates from NSS database: "
-			  "%s/%s\n",
-			  httpd_conf_dir, new_dbdir_name);
-	}
+	int rootfd, srcfd, destfd;
+	int64_t db_ns, copy_ns, del_ns;
+	uint64_t files, bytes;
+	struct timespec start;
+	unsigned int p99;
 
-	INFO("Deleting existing certificates for %s from NSS database: %s/%s\n",
-	     cert_hostname, httpd_conf_dir, new_dbdir_name);
+	/* Fixed names, so failure messages identify the directories */
+	memcpy(old_dbdir_name, "alias-00000000000000000", NSSDB_DIR_PTN_SIZE);
+	memcpy(new_dbdir_name, "alias-00000000000000001", NSSDB_DIR_PTN_SIZE);
 
-	for (	deleted = 0,
-		node = CERT_LIST_HEAD(list);
-				!CERT_LIST_END(node, list);
-						node = CERT_LIST_NEXT(node)) {
+	/*
+	 * parse_args() returns before the NSS user lookup in benchmark mode,
+	 * so nss_uid/nss_gid are still 0; the scratch files should just keep
+	 * the invoking user's ownership.
+	 */
+	nss_uid = geteuid();
+	nss_gid = getegid();
 
-		DEBUG("  %s: expires %s\n", node->cert->nickname,
-		      format_not_after(node->cert));
+	if (mkdtemp(scratch) == NULL)
+		FATAL("Failed to create scratch directory: %m\n");
 
-		if (strcmp(node->cert->nickname, cert_hostname) != 0) {
-			DEBUG("    ... ignoring\n");
-			continue;
-		}
+	rootfd = open(scratch, O_RDONLY | O_DIRECTORY);
+	if (rootfd < 0)
+		FATAL("Failed to open directory: %s: %m\n", scratch);
 
-		DEBUG("    ... DELETING\n");
+	srcfd = bench_create_tree(rootfd);
 
-		if (SEC_DeletePermCertificate(node->cert) != SECSuccess) {
-			NSS_FATAL("Failed to delete certificate for %s "
-				  "expiring %s from NSS database: %s/%s\n",
-				  cert_hostname, format_not_after(node->cert),
-				  httpd_conf_dir, new_dbdir_name);
-		}
+	if (mkdirat(rootfd, new_dbdir_name, 0755) < 0) {
+		FATAL("Failed to create directory: %s/%s: %m\n",
+		      scratch, new_dbdir_name);
+	}
 
-		++deleted;
+	destfd = openat(rootfd, new_dbdir_name, O_RDONLY | O_DIRECTORY);
+	if (destfd < 0) {
+		FATAL("Failed to open directory: %s/%s: %m\n",
+		      scratch, new_dbdir_name);
 	}
 
-	INFO("Deleted %u existing certificate(s)\n", deleted);
+	printf("Benchmarking in %s (%u files, %u subdirs, %u links)\n",
+	       scratch, bench_num_files, bench_num_subdirs, bench_num_links);
 
-	CERT_DestroyCertList(list);
-}
+	if (clock_gettime(CLOCK_MONOTONIC, &start) < 0)
+		FATAL("Failed to read monotonic clock: %m\n");
+	copy_nssdb_files(srcfd, destfd);
+	db_ns = bench_elapsed_ns(&start);
 
-static void add_new_cert(PK11SlotInfo *const restrict slot,
-			 CERTCertificate *const restrict cert)
-{
-	if (PK11_ImportCert(slot, cert, 0, cert_hostname, 0) != SECSuccess) {
-		NSS_FATAL("Failed to add certificate for %s to NSS database: "
-			  "%s/%s\n",
-			  cert_hostname, httpd_conf_dir, new_dbdir_name);
-	}
+	files = timing_files_copied;
+	bytes = timing_bytes_copied;
 
-	NOTICE("Updated mod_nss certificate for %s\n", cert_hostname);
-	NOTICE("New certificate valid until %s\n", format_not_after(cert));
-}
+	if (clock_gettime(CLOCK_MONOTONIC, &start) < 0)
+		FATAL("Failed to read monotonic clock: %m\n");
+	copy_nssdb_dir(srcfd, destfd);
+	copy_ns = bench_elapsed_ns(&start);
 
+	files = timing_files_copied - files;
+	bytes = timing_bytes_copied - bytes;
 
-/*******************************************************************************
- *
- *
- * 	main()
- *
- *
- ******************************************************************************/
+	if (clock_gettime(CLOCK_MONOTONIC, &start) < 0)
+		FATAL("Failed to read monotonic clock: %m\n");
+	delete_dir_contents(destfd, new_dbdir_name, "");
+	del_ns = bench_elapsed_ns(&start);
 
-static void set_effective_user(const uid_t uid, const gid_t gid)
-{
-	if (setegid(gid) != 0) {
-		FATAL("Failed to change effective GID to %" PRIdMAX ": %m\n",
-		      (intmax_t)gid);
-	}
+	printf("copy_nssdb_files:    %9.3f ms\n", db_ns / 1e6);
+	printf("copy_nssdb_dir:      %9.3f ms  (%" PRIu64 " files, %" PRIu64
+	       " bytes, %.1f MB/s)\n",
+	       copy_ns / 1e6, files, bytes,
+	       copy_ns > 0 ? bytes / (copy_ns / 1e9) / 1e6 : 0.0);
+	printf("delete_dir_contents: %9.3f ms\n", del_ns / 1e6);
 
-	if (seteuid(uid) != 0) {
-		FATAL("Failed to change effective UID to %" PRIdMAX ": %m\n",
-		      (intmax_t)uid);
+	if (num_bench_latencies > 0) {
+
+		qsort(bench_latencies, num_bench_latencies,
+		      sizeof *bench_latencies, bench_latency_cmp);
+
+		p99 = (unsigned int)
+			((uint64_t)num_bench_latencies * 99 / 100);
+		if (p99 >= num_bench_latencies)
+			p99 = num_bench_latencies - 1;
+
+		printf("per-file copy latency: p50 %.1f us, p99 %.1f us "
+		       "(%u samples)\n",
+		       bench_latencies[num_bench_latencies / 2] / 1e3,
+		       bench_latencies[p99] / 1e3, num_bench_latencies);
 	}
 
-	if (geteuid() != uid) {
-		FATAL("Effective UID not really changed (still %" PRIdMAX ")\n",
-		      (intmax_t)geteuid());
+	/* Clean up the scratch directory */
+
+	delete_dir_contents(srcfd, old_dbdir_name, "");
+
+	if (unlinkat(rootfd, old_dbdir_name, AT_REMOVEDIR) < 0) {
+		FATAL("Failed to remove directory: %s/%s: %m\n",
+		      scratch, old_dbdir_name);
 	}
 
-	if (getegid() != gid) {
-		FATAL("Effective GID not really changed (still %" PRIdMAX ")\n",
-		      (intmax_t)getegid());
+	if (unlinkat(rootfd, new_dbdir_name, AT_REMOVEDIR) < 0) {
+		FATAL("Failed to remove directory: %s/%s: %m\n",
+		      scratch, new_dbdir_name);
 	}
 
-	DEBUG("Effective uid/gid changed to %" PRIdMAX "/%" PRIdMAX "\n",
-	      (intmax_t)uid, (intmax_t)gid);
+	if (close(srcfd) < 0 || close(destfd) < 0 || close(rootfd) < 0)
+		FATAL("Failed to close directory: %m\n");
+
+	if (rmdir(scratch) < 0)
+		FATAL("Failed to remove directory: %s: %m\n", scratch);
 }
 
 int main(int argc, char **const argv)
 {
-	int httpd_conf_dirfd, new_nssdb_dirfd, old_nssdb_dirfd;
-	CERTCertificate *cert;
-	PK11SlotInfo *slot;
-	struct stat linkst;
-	uid_t saved_uid;
-	gid_t saved_gid;
+	if (atexit(log_flush) != 0)
+		abort();
 
 	parse_args(argc, argv);
 
-	httpd_conf_dirfd = open(httpd_conf_dir, O_RDONLY | O_DIRECTORY);
-	if (httpd_conf_dirfd < 0)
-		FATAL("Failed to open directory: %s: %m\n", httpd_conf_dir);
-
-	old_nssdb_dirfd = old_nssdb_dir(httpd_conf_dirfd, &linkst);
-	new_nssdb_dirfd = new_nssdb_dir(httpd_conf_dirfd);
-	copy_nssdb_files(old_nssdb_dirfd, new_nssdb_dirfd);
-
-	saved_uid = geteuid();
-	saved_gid = getegid();
-	set_effective_user(nss_uid, nss_gid);
-
-	slot = init_libnss(new_nssdb_dirfd);
-	cert = new_certificate();
-	remove_old_certs(slot);
-	add_new_cert(slot, cert);
-	CERT_DestroyCertificate(cert);
-	shutdown_libnss(slot);
+	if (use_uring)
+		uring_setup();
 
-	set_effective_user(saved_uid, saved_gid);
+	if (bench_mode) {
+		run_bench();
+		return EXIT_SUCCESS;
+	}
 
-	copy_nssdb_dir(old_nssdb_dirfd, new_nssdb_dirfd);
-	update_nssdb_symlink(httpd_conf_dirfd, &linkst);
+	if (prestage_mode) {
+		run_prestage();
+		return EXIT_SUCCESS;
+	}
 
-	delete_old_nssdb_dir(httpd_conf_dirfd, old_nssdb_dirfd);
+	if (daemon_mode)
+		run_daemon();
 
-	if (close(new_nssdb_dirfd) < 0) {
-		FATAL("Failed to close directory: %s/%s: %m\n",
-		      httpd_conf_dir, new_dbdir_name);
+	if (scan_new_certs) {
+		scan_acme_cert_dir();
+		if (num_cert_hostnames == 0) {
+			NOTICE("No new certificates found in %s\n",
+			       acme_cert_dir);
+			return EXIT_SUCCESS;
+		}
 	}
 
-	if (close(old_nssdb_dirfd) < 0) {
-		FATAL("Failed to close directory: %s/%s: %m\n",
-		      httpd_conf_dir, old_dbdir_name);
-	}
+	run_update();
 
-	if (close(httpd_conf_dirfd) < 0)
-		FATAL("Failed to close directory: %s: %m\n", httpd_conf_dir);
+	return EXIT_SUCCESS;
 }